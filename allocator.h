@@ -9,18 +9,132 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sys/syscall.h>
 
 #define PAGE_SIZE 4096
+#define CACHE_LINE_SIZE 64
+
+// Persistence backend, chosen at build time:
+//   PERSIST_CLWB, PERSIST_CLFLUSHOPT, PERSIST_CLFLUSH: flush the cache lines
+//     covering [addr, addr+len) and fence, for DAX/pmem mounts
+//   PERSIST_MSYNC: msync the pages covering the range (default with MMAP)
+//   PERSIST_NONE:  no-op (default without MMAP)
+#if !defined(PERSIST_CLWB) && !defined(PERSIST_CLFLUSHOPT) && !defined(PERSIST_CLFLUSH) \
+    && !defined(PERSIST_MSYNC) && !defined(PERSIST_NONE)
+#ifdef MMAP
+#define PERSIST_MSYNC
+#else
+#define PERSIST_NONE
+#endif
+#endif
+
+#if defined(PERSIST_CLWB) || defined(PERSIST_CLFLUSHOPT) || defined(PERSIST_CLFLUSH)
+#define PERSIST_CACHELINE
+#endif
+
+#ifndef SLAB_CHUNK_SIZE
+#define SLAB_CHUNK_SIZE ((size_t)2 * 1024 * 1024)
+#endif
+
+#ifndef GROUP_COMMIT_INTERVAL_US
+#define GROUP_COMMIT_INTERVAL_US 200
+#endif
+
+// workers refill their pools from the shared region in chunks of this size
+#ifndef POOL_CHUNK_SIZE
+#define POOL_CHUNK_SIZE ((size_t)4 * 1024 * 1024)
+#endif
+
+// Pool backing, chosen at build time:
+//   POOL_HUGETLB:       map the DRAM pool with MAP_HUGETLB (needs reserved
+//                       huge pages, falls back to normal pages)
+//   POOL_THP:           madvise(MADV_HUGEPAGE) the pool and the page arenas
+//   POOL_POPULATE:      MAP_POPULATE the whole pool when it is mapped
+//   POOL_PRETOUCH_MB=n: fault in the first n MiB of the pool with one thread
+//                       per worker before the tree is used
+#ifdef POOL_POPULATE
+#define POOL_MAP_FLAGS MAP_POPULATE
+#else
+#define POOL_MAP_FLAGS 0
+#endif
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+// retired objects a thread collects before it tries to reclaim them
+#ifndef RECLAIM_BATCH
+#define RECLAIM_BATCH 64
+#endif
+// The pool is mapped at a fixed address so the persisted list pointers stay
+// valid across restarts.
+#define POOL_BASE_ADDR ((void*)0x600000000000)
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
 thread_local int worker_id = -1;
+// set while an operation defers its msyncs to the group commit flusher
+thread_local bool persist_deferred = false;
+thread_local uint64_t persist_epoch = 0;
 int fd = -1;
 static const uint64_t pool_size_set = (uint64_t)16 * 1024 * 1024 * 1024;
 
+// NUMA node of the CPU the calling thread runs on.
+inline int current_node(){
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return 0;
+    return node;
+}
+
+// Let the pages of [addr, addr+len) that are not backed yet come from node.
+// Placement is a hint: errors, e.g. from a kernel without NUMA, are ignored.
+inline void place_on_node(void *addr, size_t len, int node){
+    unsigned long mask[16] = {0};
+    if (node < 0 || node >= (int)(sizeof(mask) * 8))
+        return;
+    mask[node / 64] = 1UL << (node % 64);
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+}
+
+// Pool blocks come in size classes so that a freed block serves any request
+// of its class: multiples of 16 bytes up to 256, then four classes per power
+// of two, the largest 25% bigger than the smallest size it takes.
+#define POOL_SMALL_CLASSES 16
+#define POOL_NR_CLASSES (POOL_SMALL_CLASSES + 4 * (48 - 8))
+
+static inline int pool_size_class(size_t size){
+    if (size <= 256)
+        return (size > 0) ? (size - 1) / 16 : 0;
+    int log = 63 - __builtin_clzll(size - 1);   // 2^log < size <= 2^(log+1)
+    return POOL_SMALL_CLASSES + (log - 8) * 4 + (int)(((size - 1) >> (log - 2)) & 3);
+}
+
+static inline size_t pool_class_size(int c){
+    if (c < POOL_SMALL_CLASSES)
+        return (size_t)(c + 1) * 16;
+    int log = (c - POOL_SMALL_CLASSES) / 4 + 8;
+    return ((size_t)1 << log) + ((size_t)((c - POOL_SMALL_CLASSES) % 4 + 1) << (log - 2));
+}
+
+// Size of the block alloc(size) hands out.
+static inline size_t pool_block_size(size_t size){
+    return pool_class_size(pool_size_class(size));
+}
+
+// A worker's current chunk of the pool region, allocated by bumping.
 class CLMemPool{
 public: 
     char *m_buf;
     size_t m_size;
     char *m_current;
     char *m_end;
+    void *m_free[POOL_NR_CLASSES];
 
 public:
     CLMemPool(){
@@ -28,6 +142,7 @@ public:
         m_size = 0;
         m_current = nullptr;
         m_end = nullptr;
+        memset(m_free, 0, sizeof(m_free));
     }
 
     void initialize(char* start, size_t size){
@@ -45,6 +160,13 @@ public:
     }
 
     void* Allocate(size_t size){
+        int c = pool_size_class(size);
+        void *f = m_free[c];
+        if (f != nullptr) {
+            m_free[c] = *(void **)f;
+            return f;
+        }
+        size = pool_class_size(c);
         if (m_current + size <= m_end){
             register char *p;
             p = m_current;
@@ -53,14 +175,84 @@ public:
         }
         return nullptr;
     }
+
+    // Reclaimed blocks are kept on one list per size class. The lists live
+    // in DRAM only; after a restart the cursor moves past whatever is live
+    // and the free blocks below it are not reused.
+    void Free(void *p, size_t size){
+        int c = pool_size_class(size);
+        *(void **)p = m_free[c];
+        m_free[c] = p;
+    }
+};
+
+// Per-thread allocator of fixed-size DRAM slots. Slots are cut from large
+// aligned chunks placed on the thread's NUMA node; freed slots are kept on
+// a free list threaded through their first word and handed out again
+// before the chunk is touched.
+class CLSlabPool{
+public:
+    size_t m_slot_size;
+    char *m_current;
+    char *m_end;
+    void *m_free;
+
+public:
+    CLSlabPool(size_t slot_size){
+        m_slot_size = slot_size;
+        m_current = nullptr;
+        m_end = nullptr;
+        m_free = nullptr;
+    }
+
+    // Chunks are not returned on thread exit, the slots outlive the thread.
+    ~CLSlabPool(){}
+
+    void* Allocate(){
+        if (m_free != nullptr){
+            void *p = m_free;
+            m_free = *(void **)p;
+            return p;
+        }
+        if (m_current + m_slot_size > m_end){
+            void* tmp_buf;
+#ifdef POOL_THP
+            if (posix_memalign(&tmp_buf, HUGE_PAGE_SIZE, SLAB_CHUNK_SIZE)){
+#else
+            if (posix_memalign(&tmp_buf, PAGE_SIZE, SLAB_CHUNK_SIZE)){
+#endif
+                perror(nullptr);
+                exit(-1);
+            }
+#ifdef POOL_THP
+            madvise(tmp_buf, SLAB_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+            m_current = (char*) tmp_buf;
+            m_end = m_current + SLAB_CHUNK_SIZE;
+            place_on_node(m_current, SLAB_CHUNK_SIZE, current_node());
+        }
+        void *p = m_current;
+        m_current += m_slot_size;
+        return p;
+    }
+
+    void Free(void *p){
+        *(void **)p = m_free;
+        m_free = p;
+    }
 };
 
+// One region shared by all workers. Each worker allocates from its own chunk
+// and takes the next one off the shared cursor when it runs dry, so no
+// worker runs out while others sit on unused space. The region is mapped
+// without reserving memory up front, pages are only backed once touched.
 class CLThreadPMPool{
 public: 
     CLMemPool *m_pools;
     int m_thread_num;
     char *m_buf;
     size_t m_pool_size;
+    std::atomic<size_t> m_cursor;   // offset of the first chunk not handed out
 
 public:
     CLThreadPMPool(){
@@ -68,40 +260,116 @@ public:
         m_buf = nullptr;
         m_pool_size = 0;
         m_thread_num = 0;
+        m_cursor = 0;
     }
 
-    void initialize(size_t pool_size, int threadNum){
+    void initialize(size_t pool_size, int threadNum, bool isRecover = false){
         m_thread_num = threadNum;
 
         m_pools = new CLMemPool[threadNum];
-        size_t sizeOfPool = (pool_size/(threadNum+threadNum-2)/PAGE_SIZE)*PAGE_SIZE;
-        m_pool_size = sizeOfPool*(threadNum+threadNum-2);
+        m_pool_size = (pool_size/POOL_CHUNK_SIZE)*POOL_CHUNK_SIZE;
+        m_cursor = 0;
         
 #ifdef MMAP    
         fd = open("largefile", O_RDWR);
         if (fd == -1) {
             perror("open");
+            if (isRecover)
+                exit(-1);
             return;
         }
-        char* mapped = (char*) mmap(nullptr, m_pool_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        char* mapped = (char*) MAP_FAILED;
+#ifdef PERSIST_CACHELINE
+        // on DAX, MAP_SYNC makes cache line flushes enough for durability
+        mapped = (char*) mmap(POOL_BASE_ADDR, m_pool_size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC | MAP_FIXED_NOREPLACE | MAP_NORESERVE | POOL_MAP_FLAGS, fd, 0);
+        if (mapped == MAP_FAILED)
+            std::cout << "MAP_SYNC unavailable, cache line flushes are not durable on this mount" << std::endl;
+#endif
+        if (mapped == MAP_FAILED)
+            mapped = (char*) mmap(POOL_BASE_ADDR, m_pool_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE | MAP_NORESERVE | POOL_MAP_FLAGS, fd, 0);
         if (mapped == MAP_FAILED) {
             perror("mmap");
             close(fd);
+            if (isRecover)
+                exit(-1);
             return;
         }
         m_buf = mapped;
 #else
-        void* tmp_buf;
-        int resAlloc = posix_memalign(&tmp_buf,64,m_pool_size);
-        if(resAlloc){
-            perror(nullptr);
+        if (isRecover) {
+            std::cout << "recovery needs the MMAP pool" << std::endl;
             exit(-1);
         }
-        m_buf = (char*) tmp_buf;
+        char* mapped = (char*) MAP_FAILED;
+#ifdef POOL_HUGETLB
+        // no MAP_NORESERVE: a fault without a free huge page would SIGBUS
+        mapped = (char*) mmap(nullptr, m_pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | POOL_MAP_FLAGS, -1, 0);
+        if (mapped == MAP_FAILED)
+            std::cout << "MAP_HUGETLB failed, not enough huge pages reserved" << std::endl;
+#endif
+        if (mapped == MAP_FAILED)
+            mapped = (char*) mmap(nullptr, m_pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | POOL_MAP_FLAGS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            perror("mmap");
+            exit(-1);
+        }
+        m_buf = mapped;
+#endif
+#ifdef POOL_THP
+        madvise(m_buf, m_pool_size, MADV_HUGEPAGE);
 #endif
-        m_pools[0].initialize(m_buf, sizeOfPool*(threadNum-1));
-        for (int i = 1; i < threadNum; i++)
-            m_pools[i].initialize(m_buf + (i-1+threadNum-1) * sizeOfPool, sizeOfPool);
+#ifdef POOL_PRETOUCH_MB
+        pretouch(std::min((size_t)POOL_PRETOUCH_MB << 20, m_pool_size), threadNum);
+#endif
+    }
+
+    // Fault in [m_buf, m_buf+len) with threadNum threads. The anonymous pool
+    // needs a write per page, a read would only map the zero page; each page
+    // gets the value it holds written back. The file mapping is only read,
+    // a write would dirty the page and msync would write it back. First
+    // touch decides the node of a page, so pretouched pages ignore the
+    // placement hint of refill().
+    void pretouch(size_t len, int threadNum){
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadNum; t++) {
+            threads.emplace_back([=](){
+                size_t start = len / threadNum * t / PAGE_SIZE * PAGE_SIZE;
+                size_t end = (t == threadNum - 1) ? len : len / threadNum * (t + 1) / PAGE_SIZE * PAGE_SIZE;
+                for (size_t off = start; off < end; off += PAGE_SIZE) {
+                    volatile char *p = m_buf + off;
+#ifdef MMAP
+                    (void)*p;
+#else
+                    *p = *p;
+#endif
+                }
+            });
+        }
+        for (auto &th : threads)
+            th.join();
+    }
+
+    // Hand worker a fresh chunk that fits size bytes, placed on the node the
+    // worker runs on. Returns false once the region is used up. On DAX the
+    // file's namespace decides the node, the hint only helps the DRAM pool
+    // and the page cache.
+    bool refill(int worker, size_t size){
+        size = pool_block_size(size);
+        size_t len = std::max(POOL_CHUNK_SIZE, (size + POOL_CHUNK_SIZE - 1) / POOL_CHUNK_SIZE * POOL_CHUNK_SIZE);
+        size_t offset = m_cursor.fetch_add(len);
+        if (offset + len > m_pool_size)
+            return false;
+        m_pools[worker].initialize(m_buf + offset, len);
+        place_on_node(m_buf + offset, len, current_node());
+        return true;
+    }
+
+    // Used by recovery: move the cursor past the chunk holding a live object,
+    // whatever chunk layout wrote it. The rest of such a chunk is not reused.
+    void reserve(char* addr, size_t size){
+        size_t end = (addr + size - m_buf + POOL_CHUNK_SIZE - 1) / POOL_CHUNK_SIZE * POOL_CHUNK_SIZE;
+        if (end > m_cursor.load())
+            m_cursor.store(end);
     }
 
     ~CLThreadPMPool(){
@@ -109,7 +377,7 @@ public:
         munmap(m_buf, m_pool_size);
         close(fd);
 #else
-        free(m_buf);
+        munmap(m_buf, m_pool_size);
 #endif
         m_buf = nullptr;
         m_pool_size = 0;
@@ -119,29 +387,281 @@ public:
     }
 };
 
+// Group commit for the msync backend. Deferred persists only record the
+// pages they touched in the worker's dirty list; the flusher thread closes
+// the current epoch, syncs the collected pages in merged runs and then
+// publishes the epoch as durable.
+class CLGroupCommit{
+public:
+    struct alignas(64) DirtyList{
+        std::mutex mtx;
+        std::vector<char*> pages;   // new nodes, value and key blobs
+        std::vector<char*> links;   // stores that publish them, prev->next
+    };
+
+    DirtyList *m_dirty;
+    int m_thread_num;
+    std::atomic<uint64_t> m_epoch;
+    std::atomic<uint64_t> m_durable;
+    std::atomic<bool> m_stop;
+    std::thread m_flusher;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+
+public:
+    CLGroupCommit(){
+        m_dirty = nullptr;
+        m_thread_num = 0;
+        m_epoch = 1;
+        m_durable = 0;
+        m_stop = false;
+    }
+
+    void start(int threadNum){
+        m_thread_num = threadNum;
+        m_dirty = new DirtyList[threadNum];
+        m_flusher = std::thread([this](){
+            while (!m_stop.load()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(GROUP_COMMIT_INTERVAL_US));
+                flush();
+            }
+            flush();
+        });
+    }
+
+    void stop(){
+        if (m_dirty == nullptr)
+            return;
+        m_stop = true;
+        m_flusher.join();
+        delete [] m_dirty;
+        m_dirty = nullptr;
+    }
+
+    // Returns the epoch whose flush will cover [addr, addr+len). link marks
+    // a store that makes data recorded before it reachable.
+    uint64_t record(char* addr, int len, bool link = false){
+        DirtyList &list = m_dirty[worker_id];
+        char* page = (char*)(~((uintptr_t)PAGE_SIZE - 1) & (uintptr_t)addr);
+        std::lock_guard<std::mutex> guard(list.mtx);
+        // read under the lock so the flusher cannot close the epoch between
+        // reading it and publishing the pages
+        uint64_t epoch = m_epoch.load();
+        std::vector<char*> &pages = link ? list.links : list.pages;
+        for (; page < addr + len; page += PAGE_SIZE)
+            pages.push_back(page);
+        return epoch;
+    }
+
+    static void msync_pages(const std::vector<char*> &pages){
+        for (size_t i = 0; i < pages.size(); ) {
+            size_t j = i + 1;
+            while (j < pages.size() && pages[j] == pages[j-1] + PAGE_SIZE)
+                j++;
+            if (msync(pages[i], (j - i) * PAGE_SIZE, MS_SYNC) == -1) {
+                perror("msync");
+                std::cout << "msync: error" << std::endl;
+            }
+            i = j;
+        }
+    }
+
+    // The epoch's data goes out before the links to it: pages holding only
+    // data first, then pages holding both, then pages holding only links.
+    // Links in a page of the middle group can still reach another page of
+    // it first. Only the flusher's own writes are ordered, not the kernel's
+    // writeback of a page.
+    void flush(){
+        uint64_t epoch = m_epoch.fetch_add(1);
+        std::vector<char*> data, links;
+        for (int i = 0; i < m_thread_num; i++) {
+            std::lock_guard<std::mutex> guard(m_dirty[i].mtx);
+            data.insert(data.end(), m_dirty[i].pages.begin(), m_dirty[i].pages.end());
+            links.insert(links.end(), m_dirty[i].links.begin(), m_dirty[i].links.end());
+            m_dirty[i].pages.clear();
+            m_dirty[i].links.clear();
+        }
+
+        std::sort(data.begin(), data.end());
+        data.erase(std::unique(data.begin(), data.end()), data.end());
+        std::sort(links.begin(), links.end());
+        links.erase(std::unique(links.begin(), links.end()), links.end());
+        std::vector<char*> dataOnly, both, linksOnly;
+        std::set_difference(data.begin(), data.end(), links.begin(), links.end(), std::back_inserter(dataOnly));
+        std::set_intersection(data.begin(), data.end(), links.begin(), links.end(), std::back_inserter(both));
+        std::set_difference(links.begin(), links.end(), data.begin(), data.end(), std::back_inserter(linksOnly));
+        msync_pages(dataOnly);
+        msync_pages(both);
+        msync_pages(linksOnly);
+
+        {
+            std::lock_guard<std::mutex> guard(m_mtx);
+            m_durable.store(epoch);
+        }
+        m_cv.notify_all();
+    }
+
+    void wait(uint64_t epoch){
+        if (m_durable.load() >= epoch)
+            return;
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [&](){ return m_durable.load() >= epoch; });
+    }
+};
+
+// Epoch based reclamation. A worker announces the global epoch while it may
+// hold pointers into the index and 0 while it is outside. An object retired
+// in epoch e is released once the epoch reached e+2: the epoch only moves on
+// when every announcing worker has seen the current one, so nobody can still
+// reach the object. Release runs on the retiring worker and hands the memory
+// to its own free lists.
+class CLEpochReclaimer{
+public:
+    struct Retired{
+        void *ptr;
+        void (*release)(void *);
+        uint64_t epoch;
+    };
+
+    struct alignas(64) Worker{
+        std::atomic<uint64_t> announced;
+        int depth;
+        std::vector<Retired> retired;
+    };
+
+    Worker *m_workers;
+    int m_thread_num;
+    std::atomic<uint64_t> m_epoch;
+
+public:
+    CLEpochReclaimer(){
+        m_workers = nullptr;
+        m_thread_num = 0;
+        m_epoch = 1;
+    }
+
+    void start(int threadNum){
+        m_thread_num = threadNum;
+        m_workers = new Worker[threadNum];
+        for (int i = 0; i < threadNum; i++) {
+            m_workers[i].announced = 0;
+            m_workers[i].depth = 0;
+        }
+    }
+
+    // Retired objects still pending are dropped with the pools.
+    void stop(){
+        delete [] m_workers;
+        m_workers = nullptr;
+    }
+
+    // Calls nest; only the outermost one announces.
+    inline void enter(){
+        Worker &w = m_workers[worker_id];
+        if (w.depth++ == 0)
+            w.announced.store(m_epoch.load(std::memory_order_relaxed));
+    }
+
+    inline void exit(){
+        Worker &w = m_workers[worker_id];
+        if (--w.depth == 0)
+            w.announced.store(0, std::memory_order_release);
+    }
+
+    void retire(void *ptr, void (*release)(void *)){
+        Worker &w = m_workers[worker_id];
+        w.retired.push_back(Retired{ptr, release, m_epoch.load()});
+        if (w.retired.size() >= RECLAIM_BATCH)
+            reclaim();
+    }
+
+    void reclaim(){
+        uint64_t epoch = m_epoch.load();
+        bool advance = true;
+        for (int i = 0; i < m_thread_num && advance; i++) {
+            uint64_t a = m_workers[i].announced.load();
+            advance = (a == 0 || a == epoch);
+        }
+        if (advance && m_epoch.compare_exchange_strong(epoch, epoch + 1))
+            ++epoch;
+
+        std::vector<Retired> &retired = m_workers[worker_id].retired;
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++) {
+            if (retired[i].epoch + 2 <= epoch)
+                retired[i].release(retired[i].ptr);
+            else
+                retired[kept++] = retired[i];
+        }
+        retired.resize(kept);
+    }
+};
+
 CLThreadPMPool* pmAllocator = new CLThreadPMPool();
+CLGroupCommit* groupCommit = new CLGroupCommit();
+CLEpochReclaimer* epochManager = new CLEpochReclaimer();
+
+// Keeps the calling worker inside an epoch for its lifetime.
+struct CLEpochGuard{
+    CLEpochGuard(){ epochManager->enter(); }
+    ~CLEpochGuard(){ epochManager->exit(); }
+};
 
 void initializeMemoryPool(int threadNum, bool isRecover = false){
-    pmAllocator->initialize(pool_size_set, threadNum);
+    pmAllocator->initialize(pool_size_set, threadNum, isRecover);
+    epochManager->start(threadNum);
+#ifdef PERSIST_MSYNC
+    groupCommit->start(threadNum);
+#endif
 }
 
 void closeMemoryPool(){
+    groupCommit->stop();
+    epochManager->stop();
     pmAllocator->~CLThreadPMPool();
 }
 
-inline void persist(char *addr, int len){
-#ifdef MMAP 
-    char* aligned_addr = (char*)(~((uintptr_t)0xFFF) & (uintptr_t)addr);
-    if (msync(aligned_addr, 4096, MS_SYNC) == -1) {
+inline void flush_line(char *line){
+#if defined(PERSIST_CLWB)
+    asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)line));
+#elif defined(PERSIST_CLFLUSHOPT)
+    asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)line));
+#elif defined(PERSIST_CLFLUSH)
+    asm volatile("clflush %0" : "+m" (*(volatile char *)line));
+#endif
+}
+
+// link marks a store that publishes data persisted before it, a list link
+// or a value pointer; a deferred one is written back after the epoch's data.
+inline void persist(char *addr, int len, bool link = false){
+    (void)link;
+#if defined(PERSIST_CACHELINE)
+    char* line = (char*)(~((uintptr_t)CACHE_LINE_SIZE - 1) & (uintptr_t)addr);
+    for (; line < addr + len; line += CACHE_LINE_SIZE)
+        flush_line(line);
+    asm volatile("sfence" ::: "memory");
+#elif defined(PERSIST_MSYNC)
+    if (persist_deferred) {
+        persist_epoch = std::max(persist_epoch, groupCommit->record(addr, len, link));
+        return;
+    }
+    char* aligned_addr = (char*)(~((uintptr_t)PAGE_SIZE - 1) & (uintptr_t)addr);
+    if (msync(aligned_addr, addr + len - aligned_addr, MS_SYNC) == -1) {
         perror("msync");
         std::cout << "msync: error" << std::endl;
     }
-    return;
 #endif
 }
 
 void *alloc(size_t size) {
   void* ret;
   ret = pmAllocator->m_pools[worker_id].Allocate(size);
+  if (ret == nullptr && pmAllocator->refill(worker_id, size))
+    ret = pmAllocator->m_pools[worker_id].Allocate(size);
   return ret;
-}
\ No newline at end of file
+}
+
+// Return a block of the given size to the calling worker's pool.
+void dealloc(void *p, size_t size) {
+  pmAllocator->m_pools[worker_id].Free(p, size);
+}
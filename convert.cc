@@ -0,0 +1,116 @@
+// Convert YCSB .dat workload files to the binary trace run.cc maps (-t).
+//   ./convert [load.dat] [run.dat] [out.trace]
+#include "trace.h"
+#include "ycsb.h"
+#include <ctype.h>
+#include <vector>
+
+// Whitespace separated tokens of a file mapped into memory.
+class Tokenizer{
+  private:
+    const char *p, *end;
+    void *map;
+    size_t size;
+
+  public:
+    Tokenizer() : p(NULL), end(NULL), map(NULL), size(0) {}
+
+    bool open(const char *path) {
+      int fd = ::open(path, O_RDONLY);
+      struct stat st;
+      if(fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return false;
+      }
+      size = st.st_size;
+      map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+      ::close(fd);
+      if(map == MAP_FAILED) {
+        map = NULL;
+        perror("mmap");
+        return false;
+      }
+      madvise(map, size, MADV_SEQUENTIAL);
+      p = (const char *)map;
+      end = p + size;
+      return true;
+    }
+
+    ~Tokenizer() {
+      if(map != NULL)
+        munmap(map, size);
+    }
+
+    // Next token as [*tok, *tok + len), false at the end of the file.
+    bool next(const char **tok, size_t *len) {
+      while(p < end && isspace(*p))
+        ++p;
+      if(p == end)
+        return false;
+      *tok = p;
+      while(p < end && !isspace(*p))
+        ++p;
+      *len = p - *tok;
+      return true;
+    }
+
+    bool next_number(uint64_t *v) {
+      const char *tok;
+      size_t len;
+      if(!next(&tok, &len))
+        return false;
+      *v = 0;
+      for(size_t i = 0; i < len; i++)
+        *v = *v * 10 + (tok[i] - '0');
+      return true;
+    }
+};
+
+static uint8_t op_code(const char *tok, size_t len) {
+  if(len == 6 && memcmp(tok, "insert", 6) == 0) return YCSB_INSERT;
+  if(len == 6 && memcmp(tok, "update", 6) == 0) return YCSB_UPDATE;
+  if(len == 6 && memcmp(tok, "delete", 6) == 0) return YCSB_DELETE;
+  if(len == 4 && memcmp(tok, "scan", 4) == 0) return YCSB_SCAN;
+  if(len == 15 && memcmp(tok, "readmodifywrite", 15) == 0) return YCSB_RMW;
+  return YCSB_READ;
+}
+
+int main(int argc, char **argv) {
+  const char *loadPath = argc > 1 ? argv[1] : "insert1_zipfian_64M_load.dat";
+  const char *runPath = argc > 2 ? argv[2] : "insert1_zipfian_64M_run.dat";
+  const char *outPath = argc > 3 ? argv[3] : TRACE_FILE;
+
+  std::vector<uint64_t> loadKeys, runKeys;
+  std::vector<uint32_t> runArgs;
+  std::vector<uint8_t> runTypes;
+  const char *tok;
+  size_t len;
+  uint64_t key;
+
+  // "<op> <key>" per line
+  Tokenizer load;
+  if(!load.open(loadPath))
+    return 1;
+  while(load.next(&tok, &len) && load.next_number(&key))
+    loadKeys.push_back(key);
+
+  // "<op> <key>", scans add the range length: "scan <key> <length>"
+  Tokenizer run;
+  if(!run.open(runPath))
+    return 1;
+  while(run.next(&tok, &len) && run.next_number(&key)) {
+    uint8_t type = op_code(tok, len);
+    uint64_t range = 0;
+    if(type == YCSB_SCAN && !run.next_number(&range))
+      break;
+    runTypes.push_back(type);
+    runKeys.push_back(key);
+    runArgs.push_back((uint32_t)range);
+  }
+
+  if(!trace_write(outPath, loadKeys.data(), loadKeys.size(),
+        runKeys.data(), runArgs.data(), runTypes.data(), runTypes.size()))
+    return 1;
+  printf("%s: %zu load keys, %zu operations\n", outPath, loadKeys.size(), runTypes.size());
+  return 0;
+}
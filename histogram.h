@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+// Log-linear latency histogram in the spirit of HdrHistogram. A value goes
+// to the bucket of its highest set bit and the SUB_BUCKET_BITS bits below
+// it, so a bucket spans at most 1/32 of the values it holds. Recording is a
+// plain increment: every thread keeps its own histograms and they are
+// merged once the threads are done.
+class LatencyHistogram{
+  public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  private:
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t max;
+
+    static inline int index(uint64_t v) {
+      if(v < SUB_BUCKETS)
+        return (int)v;
+      int shift = 63 - __builtin_clzll(v) - SUB_BUCKET_BITS;
+      return (shift + 1) * SUB_BUCKETS + (int)((v >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Largest value that lands in bucket i.
+    static inline uint64_t highest(int i) {
+      if(i < SUB_BUCKETS)
+        return i;
+      int shift = i / SUB_BUCKETS - 1;
+      uint64_t sub = i % SUB_BUCKETS;
+      return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+  public:
+    LatencyHistogram() {
+      reset();
+    }
+
+    void reset() {
+      memset(counts, 0, sizeof(counts));
+      total = 0;
+      max = 0;
+    }
+
+    inline void record(uint64_t ns) {
+      counts[index(ns)]++;
+      total++;
+      if(ns > max)
+        max = ns;
+    }
+
+    void merge(const LatencyHistogram &other) {
+      for(int i = 0; i < BUCKETS; i++)
+        counts[i] += other.counts[i];
+      total += other.total;
+      if(other.max > max)
+        max = other.max;
+    }
+
+    uint64_t count() const {
+      return total;
+    }
+
+    // Smallest recorded latency that at least p percent of the samples do
+    // not exceed, rounded up to its bucket.
+    uint64_t percentile(double p) const {
+      uint64_t target = (uint64_t)(p / 100 * total + 0.5);
+      if(target == 0)
+        target = 1;
+      uint64_t seen = 0;
+      for(int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if(seen >= target)
+          return (highest(i) < max) ? highest(i) : max;
+      }
+      return max;
+    }
+
+    void print(const char *name) const {
+      printf("%-7s samples %lu  p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu (ns)\n",
+          name, total, percentile(50), percentile(90), percentile(99),
+          percentile(99.9), max);
+    }
+};
+
+static inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
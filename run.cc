@@ -1,37 +1,216 @@
 #include "utree.h"
+#include "histogram.h"
+#include "ycsb.h"
+#include "trace.h"
 #include <bits/types/struct_timeval.h>
 #include <sys/select.h>
 #include <stdio.h>
+#include <getopt.h>
+#include <algorithm>
 
 #define NR_LOAD         10000 // 64000000
 #define NR_OPERATIONS   1000000 // 64000000
 #define LOAD_YCSB      "insert1_zipfian_64M_load.dat"     
 #define RUN_YCSB       "insert1_zipfian_64M_run.dat"
+#define SCAN_LENGTH     100
 
 #define FLOOR(x, y)    ((x) / (y))
+#define NR_OP_TYPES     6
 
-uint64_t *loadKeys, *runKeys, *runTypes;
+// histogram names, indexed by runTypes
+static const char *opNames[NR_OP_TYPES] = {"read", "insert", "update", "remove", "scan", "rmw"};
+
+#ifdef STRING_KEYS
+// -DSTRING_KEYS runs the workload on string keys: every key printed as a
+// fixed width decimal, which sorts like the number does
+typedef string_btree index_t;
+#define KEY_AT(k, buf) to_string_key(k, buf)
+static inline string_ref to_string_key(uint64_t k, char *buf){
+    return string_ref{buf, (uint32_t)sprintf(buf, "%020lu", k)};
+}
+#else
+typedef btree index_t;
+#define KEY_AT(k, buf) (k)
+#endif
+#define KEY(k) KEY_AT(k, keyBuf)
+
+const uint64_t *loadKeys, *runKeys;
+const uint8_t *runTypes;
+const uint32_t *runRanges;
+long loadCount = NR_LOAD, runCount = NR_OPERATIONS;
+int scanLength = 0;
+uint64_t scanOps = 0, scanRecords = 0, readMisses = 0;
 void loadWorkLoad();
 
 int main(int argc, char **argv){
     int threadNum = atoi(argv[1]);
 
-    loadKeys = new uint64_t[NR_LOAD];
-    runKeys = new uint64_t[NR_OPERATIONS];
-    runTypes = new uint64_t[NR_OPERATIONS];
+    // ./a.out <threads> [-s scan_length] [-r] [-b fill_factor] [-g] [-p] [-l sample_every]
+    //         [-v value_size] [-B batch] [-t trace] [-w A-F] [-d zipfian|uniform|latest|sequential] [-z theta]
+    //         [-m read,update,insert,delete,scan] [-N records] [-O operations]
+    // Any of -w/-d/-z/-m/-N/-O generates the workload in process instead of
+    // reading the .dat files; -t maps a trace written by ./convert instead.
+    // -v stores values of that many bytes with put() and reads them with get()
+    // instead of keeping the key as an 8-byte pointer value. -B loads batch
+    // keys per insert_batch() call and hands runs of up to batch reads to
+    // multi_get(); each read gets the batch's average latency.
+    int opt;
+    YcsbSpec spec;
+    bool generate = false, badArg = false;
+    spec.records = NR_LOAD;
+    spec.operations = NR_OPERATIONS;
+    int sampleEvery = 1;
+    bool recover = false;
+    bool groupCommit = false;
+    bool pin = false;
+    double fillFactor = 0;
+    const char *tracePath = NULL;
+    int valueSize = 0;
+    int batch = 1;
+    // -d, -z and -m refine the -w preset whatever order they come in
+    char preset = 0;
+    const char *distArg = NULL, *mixArg = NULL;
+    optind = 2;
+    while((opt = getopt(argc, argv, "s:rb:gpl:v:B:t:w:d:z:m:N:O:")) != -1){
+        switch(opt){
+            case 's': scanLength = atoi(optarg); break;
+            case 'r': recover = true; break;
+            case 'b': fillFactor = atof(optarg); badArg |= fillFactor <= 0 || fillFactor > 1; break;
+            case 'g': groupCommit = true; break;
+            case 'p': pin = true; break;
+            case 'l': sampleEvery = std::max(1, atoi(optarg)); break;
+            case 'v': valueSize = std::max(0, atoi(optarg)); break;
+            case 'B': batch = std::max(1, atoi(optarg)); break;
+            case 't': tracePath = optarg; break;
+            case 'w': generate = true; preset = optarg[0]; break;
+            case 'd': generate = true; distArg = optarg; break;
+            case 'z': generate = true; spec.theta = atof(optarg); badArg |= spec.theta <= 0 || spec.theta >= 1; break;
+            case 'm': generate = true; mixArg = optarg; break;
+            case 'N': generate = true; spec.records = std::max(1L, atol(optarg)); break;
+            case 'O': generate = true; spec.operations = std::max(1L, atol(optarg)); break;
+            default: badArg = true;
+        }
+    }
+    if(preset != 0)
+        badArg |= !spec.preset(preset);
+    if(distArg != NULL)
+        badArg |= !spec.parse_dist(distArg);
+    if(mixArg != NULL)
+        badArg |= !spec.parse_mix(mixArg);
+    if(badArg || (generate && tracePath != NULL)){
+        std::cout << "usage: " << argv[0] << " <threads> [-s scan_length] [-r] [-b fill_factor] [-g] [-p] [-l sample_every]"
+            " [-v value_size] [-B batch] [-t trace] [-w A-F] [-d zipfian|uniform|latest|sequential] [-z theta] [-m read,update,insert,delete,scan] [-N records] [-O operations]" << std::endl;
+        return -1;
+    }
 
+    YcsbWorkload *workload = NULL;
+    TraceFile trace;
     std::cout << "start load workload------------" << std::endl;
-    loadWorkLoad();
+    if(generate){
+        loadCount = spec.records;
+        runCount = spec.operations;
+        if(scanLength > 0)
+            spec.max_scan = scanLength;
+        workload = new YcsbWorkload(spec);
+        uint64_t *keys = new uint64_t[loadCount];
+        for(long i=0; i<loadCount; i++)
+            keys[i] = YcsbWorkload::key(i);
+        loadKeys = keys;
+    }else if(tracePath != NULL){
+        if(!trace.open(tracePath))
+            return -1;
+        loadCount = trace.load_count;
+        runCount = trace.run_count;
+        loadKeys = trace.load_keys;
+        runKeys = trace.run_keys;
+        runTypes = trace.run_types;
+        runRanges = trace.run_args;
+    }else{
+        loadWorkLoad();
+    }
 
     worker_id = 0;
-    btree* bt = new btree(threadNum);
-    std::cout << "warm up------------------------" << std::endl;
-    for(int i=0; i<NR_LOAD; i++){
-        bt->insert(loadKeys[i], reinterpret_cast<char*>(loadKeys[i]));
+#ifdef STRING_KEYS
+    char keyBuf[24];
+#endif
+    index_t* bt;
+    if(recover){
+        // rebuild the index from the list left in largefile by a previous run
+        std::cout << "recover------------------------" << std::endl;
+        struct timeval recoverStart, recoverEnd;
+        gettimeofday(&recoverStart, NULL);
+        bt = new index_t(threadNum, true);
+        gettimeofday(&recoverEnd, NULL);
+        std::cout << "recover time: " << (recoverEnd.tv_sec + (double)(recoverEnd.tv_usec) / 1000000) - (recoverStart.tv_sec + (double)(recoverStart.tv_usec) / 1000000) << std::endl;
+    }else{
+        bt = new index_t(threadNum);
+        std::cout << "warm up------------------------" << std::endl;
+        struct timeval loadStart, loadEnd;
+        gettimeofday(&loadStart, NULL);
+        if(fillFactor > 0){
+            // bulk load wants sorted, unique keys
+            std::vector<entry_key_t> keys(loadKeys, loadKeys + loadCount);
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            std::vector<char*> values(keys.size());
+            for(size_t i=0; i<keys.size(); i++)
+                values[i] = reinterpret_cast<char*>(keys[i]);
+#ifdef STRING_KEYS
+            std::vector<char> text(keys.size() * 24);
+            std::vector<string_ref> refs(keys.size());
+            for(size_t i=0; i<keys.size(); i++)
+                refs[i] = to_string_key(keys[i], &text[i * 24]);
+            bt->bulk_load(refs.data(), values.data(), refs.size(), fillFactor);
+#else
+            bt->bulk_load(keys.data(), values.data(), keys.size(), fillFactor);
+#endif
+        }else{
+            std::vector<char> value(valueSize, 'v');
+            std::vector<index_t::key_type> keys(batch);
+            std::vector<char*> values(batch);
+            std::vector<char> text(batch * 24);
+            for(long i=0; batch > 1 && valueSize == 0 && i<loadCount; i+=batch){
+                long n = std::min((long)batch, loadCount - i);
+                for(long j=0; j<n; j++){
+                    keys[j] = KEY_AT(loadKeys[i + j], &text[j * 24]);
+                    values[j] = reinterpret_cast<char*>(loadKeys[i + j]);
+                }
+                bt->insert_batch(keys.data(), values.data(), n);
+            }
+            for(long i=0; (batch == 1 || valueSize > 0) && i<loadCount; i++){
+                if(valueSize > 0)
+                    bt->put(KEY(loadKeys[i]), value.data(), valueSize);
+                else
+                    bt->insert(KEY(loadKeys[i]), reinterpret_cast<char*>(loadKeys[i]));
+            }
+        }
+        gettimeofday(&loadEnd, NULL);
+        double loadTime = (loadEnd.tv_sec + (double)(loadEnd.tv_usec) / 1000000) - (loadStart.tv_sec + (double)(loadStart.tv_usec) / 1000000);
+        std::cout << "load time: " << loadTime << std::endl;
+        std::cout << "load throughput: " << loadCount / loadTime << std::endl;
+    }
+
+    int maxRange = generate ? spec.max_scan : scanLength;
+    for(long i=0; !generate && scanLength == 0 && i<runCount; i++){
+        if(runTypes[i] == 4 && (int)runRanges[i] > maxRange)
+            maxRange = runRanges[i];
     }
 
+    // -p pins worker t to the t-th CPU we may run on, so it stays on the node
+    // its pool chunks were placed on
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    if(pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+        for(int c=0; c<CPU_SETSIZE; c++)
+            if(CPU_ISSET(c, &allowed))
+                cpus.push_back(c);
+    }
+
+    // per thread and operation type, -l n times only every n-th operation
+    LatencyHistogram *histograms = new LatencyHistogram[threadNum * NR_OP_TYPES];
+
     thread threads[threadNum];
-    int range = FLOOR(NR_OPERATIONS, threadNum);
+    long range = FLOOR(runCount, threadNum);
     std::cout << "start run----------------------" << std::endl;
     struct timeval startTime, endTime;
 
@@ -39,23 +218,99 @@ int main(int argc, char **argv){
     for(int t=0; t<threadNum; t++){
         threads[t] = thread([=](){
             worker_id = t+1;
-            int start = range*t;
-            struct timeval  insertStart, insertEnd;
-            double t2 = 0.0;
-            int end = ((t<threadNum-1)?start+range:NR_OPERATIONS);
-            for (int ii = start; ii < end; ii++){
-                if(runTypes[ii] == 1) {
-                    gettimeofday(&insertStart, NULL);
-                    bt->insert(runKeys[ii], reinterpret_cast<char *>(runKeys[ii]));
-                    gettimeofday(&insertEnd, NULL);
-                    t2 += (insertEnd.tv_sec + (double)(insertEnd.tv_usec) / 1000000) - (insertStart.tv_sec + (double)(insertStart.tv_usec) / 1000000);
+            if(!cpus.empty()){
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[t % cpus.size()], &set);
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            }
+            long start = range*t;
+            LatencyHistogram *hist = &histograms[t * NR_OP_TYPES];
+            long end = ((t<threadNum-1)?start+range:runCount);
+            YcsbGenerator *gen = generate ? new YcsbGenerator(workload, t) : NULL;
+            char **scanBuf = new char*[maxRange + 1];
+#ifdef STRING_KEYS
+            char keyBuf[24];
+#endif
+            char *value = new char[valueSize + 1];
+            memset(value, 'v', valueSize + 1);
+            uint64_t scans = 0, records = 0, misses = 0;
+            uint64_t epoch = 0;
+            index_t::key_type *batchKeys = new index_t::key_type[batch];
+            char **batchOut = new char*[batch];
+            long *batchOps = new long[batch];
+            std::vector<char> batchText(batch * 24);
+            int pending = 0;
+            auto flushBatch = [&](){
+                if(pending == 0)
+                    return;
+                uint64_t batchStart = now_ns();
+                bt->multi_get(batchKeys, pending, batchOut);
+                uint64_t each = (now_ns() - batchStart) / pending;
+                for(int j=0; j<pending; j++){
+                    misses += batchOut[j] == NULL;
+                    if((batchOps[j] - start) % sampleEvery == 0)
+                        hist[0].record(each);
+                }
+                pending = 0;
+            };
+            for (long ii = start; ii < end; ii++){
+                uint64_t type, key, len = 0;
+                if(gen != NULL){
+                    type = gen->next(&key, &len);
+                }else{
+                    type = runTypes[ii];
+                    key = runKeys[ii];
+                    len = runRanges[ii];
+                }
+                if(scanLength > 0)
+                    len = scanLength;
+                if(batch > 1 && type == 0 && valueSize == 0){
+                    batchKeys[pending] = KEY_AT(key, &batchText[pending * 24]);
+                    batchOps[pending] = ii;
+                    if(++pending == batch)
+                        flushBatch();
+                    continue;
+                }
+                flushBatch();
+                bool sample = (ii - start) % sampleEvery == 0;
+                uint64_t opStart = sample ? now_ns() : 0;
+                if(valueSize > 0 && (type == 1 || type == 2)) {
+                    bt->put(KEY(key), value, valueSize);
+                } else if(valueSize > 0 && type == 0) {
+                    misses += bt->get(KEY(key), value, valueSize) < 0;
+                } else if(type == 1) {
+                    if(groupCommit)
+                        epoch = bt->insert_async(KEY(key), reinterpret_cast<char *>(key));
+                    else
+                        bt->insert(KEY(key), reinterpret_cast<char *>(key));
+                } else if(type == 2) {
+                    bt->update(KEY(key), reinterpret_cast<char *>(key));
+                } else if(type == 3) {
+                    bt->remove(KEY(key));
+                } else if(type == 4) {
+                    records += bt->scan(KEY(key), len, scanBuf);
+                    scans++;
+                } else if(type == 5) {
+                    bt->read_modify_write(KEY(key), [](char *v) { return v + 1; });
                 } else {
-                    bt->search(runKeys[ii]);
+                    misses += bt->search(KEY(key)) == NULL;
                 }
+                if(sample)
+                    hist[type < NR_OP_TYPES ? type : 0].record(now_ns() - opStart);
             }
-            printf("insert time t2 = %lf\n", t2);
-            printf("search time t1 = %lf\n", t1);
-            printf("t2 - t1 = %lf\n", t2 - t1);
+            flushBatch();
+            delete gen;
+            // all inserts of this thread are durable once the last one is
+            bt->wait_durable(epoch);
+            __atomic_fetch_add(&scanOps, scans, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&scanRecords, records, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&readMisses, misses, __ATOMIC_RELAXED);
+            delete [] scanBuf;
+            delete [] value;
+            delete [] batchKeys;
+            delete [] batchOut;
+            delete [] batchOps;
         });
     }
 
@@ -63,35 +318,70 @@ int main(int argc, char **argv){
         threads[t].join();
     gettimeofday(&endTime, NULL);
     // operations / per second
-    double throughput = NR_OPERATIONS/((endTime.tv_sec + (double)(endTime.tv_usec) / 1000000) - (startTime.tv_sec + (double)(startTime.tv_usec) / 1000000));
+    double throughput = runCount/((endTime.tv_sec + (double)(endTime.tv_usec) / 1000000) - (startTime.tv_sec + (double)(startTime.tv_usec) / 1000000));
     
     std::cout << "throughput: " << throughput << std::endl; 
+    if(scanOps > 0)
+        std::cout << "scan ops: " << scanOps << ", avg range: " << (double)scanRecords / scanOps << std::endl;
+    if(readMisses > 0)
+        std::cout << "reads of missing keys: " << readMisses << std::endl;
+
+    for(int op=0; op<NR_OP_TYPES; op++){
+        LatencyHistogram merged;
+        for(int t=0; t<threadNum; t++)
+            merged.merge(histograms[t * NR_OP_TYPES + op]);
+        if(merged.count() > 0)
+            merged.print(opNames[op]);
+    }
+    delete [] histograms;
+#ifdef UTREE_STATS
+    bt->stats().print();
+#endif
+    if(tracePath != NULL)
+        trace.close();
 
     closeMemoryPool();
 }
 
 void loadWorkLoad(){
+    uint64_t *keys = new uint64_t[loadCount];
     ifstream ifs;
     ifs.open(LOAD_YCSB);
     std::string tmp;
-    for(int i=0; i<NR_LOAD; i++){
+    for(long i=0; i<loadCount; i++){
         ifs >> tmp;
-        ifs >> loadKeys[i];
+        ifs >> keys[i];
     }
     ifs.close();
+    loadKeys = keys;
+
+    uint64_t *opKeys = new uint64_t[runCount];
+    uint8_t *types = new uint8_t[runCount];
+    uint32_t *ranges = new uint32_t[runCount];
 
     ifs.open(RUN_YCSB);
-    for(int i=0; i<NR_OPERATIONS; ++i){
+    for(long i=0; i<runCount; ++i){
         ifs >> tmp;
         if(tmp == "insert")
-            runTypes[i] = 1;
+            types[i] = 1;
         else if(tmp == "update")
-            runTypes[i] = 2;
+            types[i] = 2;
         else if(tmp == "delete")
-            runTypes[i] = 3;
+            types[i] = 3;
+        else if(tmp == "scan")
+            types[i] = 4;
+        else if(tmp == "readmodifywrite")
+            types[i] = 5;
         else
-            runTypes[i] = 0;
-        ifs >> runKeys[i];
+            types[i] = 0;
+        ifs >> opKeys[i];
+        // scan lines carry the range length: "scan <key> <length>"
+        ranges[i] = SCAN_LENGTH;
+        if(types[i] == 4)
+            ifs >> ranges[i];
     }
     ifs.close();
+    runKeys = opKeys;
+    runTypes = types;
+    runRanges = ranges;
 }
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Binary workload trace, mapped by run.cc instead of parsing the .dat text.
+// After the header come, each starting on an 8 byte boundary:
+//   uint64_t load_keys[load_count]
+//   uint64_t run_keys[run_count]
+//   uint32_t run_args[run_count]   scan length, 0 for the other operations
+//   uint8_t  run_types[run_count]  YcsbOp codes
+#define TRACE_MAGIC     "UTRACE1"
+#define TRACE_FILE      "workload.trace"
+
+struct TraceHeader{
+  char magic[8];
+  uint64_t load_count;
+  uint64_t run_count;
+  uint64_t reserved;
+};
+
+static inline uint64_t trace_align(uint64_t off) {
+  return (off + 7) & ~7ULL;
+}
+
+struct TraceFile{
+  uint64_t load_count, run_count;
+  const uint64_t *load_keys, *run_keys;
+  const uint32_t *run_args;
+  const uint8_t *run_types;
+  void *map;
+  size_t map_size;
+
+  // Offsets of the arrays, in the order above.
+  static void layout(uint64_t load_count, uint64_t run_count, uint64_t off[4], uint64_t *size) {
+    off[0] = sizeof(TraceHeader);
+    off[1] = trace_align(off[0] + load_count * sizeof(uint64_t));
+    off[2] = trace_align(off[1] + run_count * sizeof(uint64_t));
+    off[3] = trace_align(off[2] + run_count * sizeof(uint32_t));
+    *size = off[3] + run_count;
+  }
+
+  // Map path read only. The pages are populated here so that the run does
+  // not take the faults.
+  bool open(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0) {
+      perror(path);
+      return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TraceHeader)) {
+      fprintf(stderr, "%s: not a trace file\n", path);
+      ::close(fd);
+      return false;
+    }
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED) {
+      perror("mmap");
+      return false;
+    }
+
+    const TraceHeader *h = (const TraceHeader *)map;
+    uint64_t off[4], size;
+    if(memcmp(h->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+      fprintf(stderr, "%s: bad trace magic\n", path);
+      close();
+      return false;
+    }
+    layout(h->load_count, h->run_count, off, &size);
+    if(size > map_size) {
+      fprintf(stderr, "%s: trace truncated\n", path);
+      close();
+      return false;
+    }
+    load_count = h->load_count;
+    run_count = h->run_count;
+    const char *base = (const char *)map;
+    load_keys = (const uint64_t *)(base + off[0]);
+    run_keys = (const uint64_t *)(base + off[1]);
+    run_args = (const uint32_t *)(base + off[2]);
+    run_types = (const uint8_t *)(base + off[3]);
+    return true;
+  }
+
+  void close() {
+    munmap(map, map_size);
+    map = NULL;
+  }
+};
+
+// Write a trace; the arrays are laid out as TraceFile expects them.
+static inline bool trace_write(const char *path, const uint64_t *load_keys, uint64_t load_count,
+    const uint64_t *run_keys, const uint32_t *run_args, const uint8_t *run_types, uint64_t run_count) {
+  FILE *f = fopen(path, "wb");
+  if(f == NULL) {
+    perror(path);
+    return false;
+  }
+  TraceHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  h.load_count = load_count;
+  h.run_count = run_count;
+
+  uint64_t off[4], size;
+  TraceFile::layout(load_count, run_count, off, &size);
+  const void *data[4] = {load_keys, run_keys, run_args, run_types};
+  uint64_t len[4] = {load_count * sizeof(uint64_t), run_count * sizeof(uint64_t),
+    run_count * sizeof(uint32_t), run_count};
+  static const char zeros[8] = {0};
+
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  uint64_t pos = sizeof(h);
+  for(int i = 0; ok && i < 4; i++) {
+    ok = fwrite(zeros, 1, off[i] - pos, f) == off[i] - pos
+      && fwrite(data[i], 1, len[i], f) == len[i];
+    pos = off[i] + len[i];
+  }
+  if(fclose(f) != 0 || !ok) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
@@ -5,7 +5,6 @@
 #include <fstream>
 #include <iostream> 
 #include <math.h>
-#include <mutex>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,9 +14,21 @@
 #include <time.h>
 #include <unistd.h>
 #include <vector>
+#include <algorithm>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include "allocator.h"
 
-#define PAGESIZE 520
+// node size in bytes, pick another one with -DPAGESIZE=<bytes>
+#ifndef PAGESIZE
+#define PAGESIZE 512
+#endif
+#define DEFAULT_FILL_FACTOR 0.7
+// lookups multi_get() keeps in flight
+#ifndef MULTIGET_GROUP
+#define MULTIGET_GROUP 8
+#endif
 #define CACHE_LINE_SIZE 64 
 #define IS_FORWARD(c) (c % 2 == 0)
 
@@ -36,8 +47,72 @@ using namespace std;
   (__atomic_compare_exchange_n(_p, _u, _v, false, __ATOMIC_ACQUIRE, \
                                __ATOMIC_ACQUIRE))
 
-double t1 = 0.0;
- 
+// Spin for a random time whose bound doubles with every failed attempt, up
+// to 1024 pauses, so threads contending on one list node drift apart.
+static inline void backoff(int attempt) {
+  thread_local uint64_t rng = 0;
+  if(rng == 0)
+    rng = (uintptr_t)&rng | 1;
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  uint64_t spins = rng & ((1ULL << (attempt < 10 ? attempt : 10)) - 1);
+  for(uint64_t i = 0; i < spins; i++)
+    __builtin_ia32_pause();
+}
+
+// Hot path event counters, compiled in with -DUTREE_STATS. Each thread
+// counts into its own block; the blocks stay registered after the thread
+// exits, so btree::stats() can add them all up. The counters are per
+// process, not per tree.
+enum stat_event {
+  STAT_INSERT_RETRY,    // insert() attempts and insert_batch() descents cut short
+  STAT_SPLIT,           // page splits
+  STAT_SIBLING_CHASE,   // searches sent on to the right sibling
+  STAT_READ_RETRY,      // optimistic page or value reads that failed to validate
+  STAT_COUNT_REREAD,    // count() steps past a stale last_index
+  STAT_SLOT_MISS,       // inserts whose leaf changed after the search
+  NR_STATS
+};
+
+struct tree_stats {
+  uint64_t count[NR_STATS];
+
+  tree_stats() {
+    memset(count, 0, sizeof(count));
+  }
+
+  void print() const {
+    static const char *names[NR_STATS] = {"insert retries", "splits", "sibling chases",
+      "read retries", "count rereads", "slot misses"};
+    for(int i = 0; i < NR_STATS; i++)
+      printf("%-15s %lu\n", names[i], count[i]);
+  }
+};
+
+#ifdef UTREE_STATS
+struct alignas(64) stat_block {
+  uint64_t count[NR_STATS];
+};
+
+std::mutex stat_blocks_mtx;
+std::vector<stat_block *> stat_blocks;
+
+static inline uint64_t *thread_stats() {
+  thread_local stat_block *block = NULL;
+  if(block == NULL) {
+    block = new stat_block();
+    std::lock_guard<std::mutex> lock(stat_blocks_mtx);
+    stat_blocks.push_back(block);
+  }
+  return block->count;
+}
+
+#define STAT_INC(e) (thread_stats()[e]++)
+#else
+#define STAT_INC(e) ((void)0)
+#endif
+
 class list_node_t {
 public:
   uint64_t ptr;  
@@ -58,41 +133,378 @@ public:
     }while(!CAS(&next, &oldValue, newValue));
   }
 
+  // The version keeps counting (mod 2^15) instead of falling back to 0, so
+  // a reader that saw an even version can tell whether a writer came by.
   inline void releaseVersion(){
-    uint64_t value = __atomic_load_n(&next, __ATOMIC_ACQUIRE);
-    if((value & versionSet) == versionSet)
-      value = ((((value & versionSet) >> 48) + 1) << 48) | (value & versionMask);
-    else
-      value = value & versionMask;
-    __atomic_store_n(&next, value, __ATOMIC_RELEASE);
+    uint64_t oldValue = __atomic_load_n(&next, __ATOMIC_ACQUIRE);
+    uint64_t newValue = 0;
+    do{
+      newValue = (((((oldValue & versionSet) >> 48) + 1) << 48) & versionSet) | (oldValue & versionMask);
+    }while(!CAS(&next, &oldValue, newValue));
+  }
+};
+
+// Values written by put() have their length in list_node_t::size. Up to 8
+// bytes are kept in ptr itself, longer ones in a pool blob {uint64_t len;
+// bytes} that ptr points to. A blob is never written again once published,
+// put() makes a new one, so readers only need ptr and size to match.
+// size 0 means ptr is a plain pointer value as stored by insert().
+const uint64_t valueSet = (uint64_t)1 << 63;
+const uint64_t inlineSet = (uint64_t)1 << 62;
+const uint64_t valueLenSet = (uint64_t)0xffffffff;
+
+// whole pool blocks, so a freed blob serves any value of its size class
+static inline size_t value_blob_size(uint64_t len) {
+  return pool_block_size(sizeof(uint64_t) + len);
+}
+
+static void free_value_blob(void *blob) {
+  dealloc(blob, value_blob_size(*(uint64_t *)blob));
+}
+
+// Free the blob of a value that was just replaced or removed once no reader
+// can be copying from it any more.
+static inline void retire_value(uint64_t ptr, uint64_t size) {
+  if((size & valueSet) != 0 && (size & inlineSet) == 0)
+    epochManager->retire((void *)ptr, free_value_blob);
+}
+
+// A key policy fixes the key type a tree is used with, how a key is kept in
+// list_node_t::key and how a page lays out its records.
+
+// 64-bit integer keys, kept as they are.
+struct int_keys {
+  typedef entry_key_t key_type;
+
+  static inline entry_key_t encode(key_type key) { return key; }
+  static inline key_type decode(entry_key_t k) { return k; }
+  static inline int compare(entry_key_t k, key_type key) { return (k > key) - (k < key); }
+  static inline key_type separator(key_type key) { return key; }
+  static inline void release_separator(key_type) {}
+  static inline void retire_separator(key_type) {}
+  static inline void reserve(entry_key_t) {}
+  static inline void release(entry_key_t) {}
+
+  static constexpr int record_size = sizeof(entry_key_t) + sizeof(char *);
+  static constexpr int page_extra = 0;
+
+  template<int cardinality>
+  struct records {
+#ifdef PAGE_SOA
+    // Keys and pointers are kept in separate arrays so the key search can
+    // compare several keys per instruction.
+    entry_key_t keys[cardinality];
+    char *ptrs[cardinality];
+
+    inline entry_key_t &key_at(int i) { return keys[i]; }
+    inline char *&ptr(int i) { return ptrs[i]; }
+#else
+    struct entry {
+      entry_key_t key;
+      char *ptr;
+    } entries[cardinality];
+
+    inline entry_key_t &key_at(int i) { return entries[i].key; }
+    inline char *&ptr(int i) { return entries[i].ptr; }
+#endif
+
+    records() {
+      for(int i = 0; i < cardinality; i++) {
+        key_at(i) = LONG_MAX;
+        ptr(i) = NULL;
+      }
+    }
+
+    inline key_type key(int i) { return key_at(i); }
+    inline int compare(int i, key_type key) { return int_keys::compare(key_at(i), key); }
+    inline bool equal(int i, key_type key) { return key_at(i) == key; }
+
+    inline void set(int i, key_type key, char *p) {
+      key_at(i) = key;
+      ptr(i) = p;
+    }
+
+    inline void move(int dst, int src) { set(dst, key_at(src), ptr(src)); }
+    inline void prepare(key_type, int) {}
+    inline void rebuild(int) {}
+
+    // Index of the first of the num_entries keys that is greater than key.
+    inline int rank(key_type key, int num_entries) {
+      int i = 0;
+#if defined(PAGE_SOA) && defined(__AVX512F__)
+      __m512i k = _mm512_set1_epi64(key);
+      for(; i + 8 <= num_entries; i += 8) {
+        __mmask8 gt = _mm512_cmpgt_epi64_mask(_mm512_loadu_si512((void *)&keys[i]), k);
+        if(gt != 0)
+          return i + __builtin_ctz(gt);
+      }
+#elif defined(PAGE_SOA) && defined(__AVX2__)
+      __m256i k = _mm256_set1_epi64x(key);
+      for(; i + 4 <= num_entries; i += 4) {
+        __m256i gt = _mm256_cmpgt_epi64(_mm256_loadu_si256((__m256i *)&keys[i]), k);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(gt));
+        if(mask != 0)
+          return i + __builtin_ctz(mask);
+      }
+#endif
+      for(; i < num_entries; i++)
+        if(key_at(i) > key)
+          return i;
+      return num_entries;
+    }
+  };
+};
+
+// A string key: len bytes at data. The tree copies the bytes into the pool
+// when it stores a new key, so callers' buffers only need to outlive the call.
+struct string_ref {
+  const char *data;
+  uint32_t len;
+};
+
+// Variable-length keys, ordered like memcmp. A key lives in the pool behind
+// its 32-bit length and list_node_t::key holds the address of its bytes, so
+// the list still describes the whole index after a restart. Pages drop the
+// prefix all their keys share and keep the next 8 bytes of every key inline,
+// big endian, so most comparisons never leave the page.
+struct string_keys {
+  typedef string_ref key_type;
+
+  static inline uint32_t length(const char *data) {
+    return *(const uint32_t *)(data - sizeof(uint32_t));
+  }
+
+  static inline size_t blob_size(uint32_t len) {
+    return pool_block_size(sizeof(uint32_t) + len);
+  }
+
+  static inline int compare(key_type a, key_type b) {
+    int c = memcmp(a.data, b.data, (a.len < b.len) ? a.len : b.len);
+    if(c != 0)
+      return c;
+    return (a.len > b.len) - (a.len < b.len);
+  }
+
+  // Number of leading bytes a and b share, at most limit.
+  static inline uint32_t common_prefix(key_type a, key_type b, uint32_t limit) {
+    if(a.len < limit)
+      limit = a.len;
+    if(b.len < limit)
+      limit = b.len;
+    uint32_t i = 0;
+    while(i < limit && a.data[i] == b.data[i])
+      ++i;
+    return i;
+  }
+
+  static entry_key_t encode(key_type key) {
+    char *blob = (char *)alloc(blob_size(key.len));
+    *(uint32_t *)blob = key.len;
+    memcpy(blob + sizeof(uint32_t), key.data, key.len);
+    persist(blob, sizeof(uint32_t) + key.len);
+    return (entry_key_t)(blob + sizeof(uint32_t));
+  }
+
+  static inline key_type decode(entry_key_t k) {
+    const char *data = (const char *)k;
+    return key_type{data, length(data)};
+  }
+
+  static inline int compare(entry_key_t k, key_type key) { return compare(decode(k), key); }
+
+  // Inner pages keep their own DRAM copy of a separator and free it when
+  // they drop it, so the key of a list node can be freed with the node.
+  static key_type separator(key_type key) {
+    char *blob = new char[blob_size(key.len)];
+    *(uint32_t *)blob = key.len;
+    memcpy(blob + sizeof(uint32_t), key.data, key.len);
+    return key_type{blob + sizeof(uint32_t), key.len};
+  }
+
+  static void release_separator(key_type key) {
+    delete [] (key.data - sizeof(uint32_t));
+  }
+
+  // release_separator() once no reader can still compare against it.
+  static void retire_separator(key_type key) {
+    epochManager->retire((void *)key.data, [](void *p) {
+      release_separator(decode((entry_key_t)p));
+    });
+  }
+
+  static inline void reserve(entry_key_t k) {
+    char *data = (char *)k;
+    pmAllocator->reserve(data - sizeof(uint32_t), blob_size(length(data)));
   }
+
+  // Free the copy encode() made.
+  static inline void release(entry_key_t k) {
+    char *data = (char *)k;
+    dealloc(data - sizeof(uint32_t), blob_size(length(data)));
+  }
+
+  static constexpr int record_size = sizeof(uint64_t) + 2 * sizeof(char *);
+  static constexpr int page_extra = sizeof(uint64_t);
+
+  // Every key stored in a page must be one of the pool copies, the page keeps
+  // the address of its bytes.
+  template<int cardinality>
+  struct records {
+    uint32_t prefix_len;            // bytes all keys of the page start with
+    uint64_t slices[cardinality];   // the 8 bytes after the prefix
+    const char *keys[cardinality];
+    char *ptrs[cardinality];
+
+    records() {
+      prefix_len = 0;
+      for(int i = 0; i < cardinality; i++) {
+        slices[i] = 0;
+        keys[i] = NULL;
+        ptrs[i] = NULL;
+      }
+    }
+
+    // Zero padded and big endian, so slices order like the bytes they hold.
+    static inline uint64_t slice(key_type key, uint32_t offset) {
+      uint64_t s = 0;
+      if(offset < key.len)
+        memcpy(&s, key.data + offset, (key.len - offset < 8) ? key.len - offset : 8);
+      return __builtin_bswap64(s);
+    }
+
+    inline char *&ptr(int i) { return ptrs[i]; }
+    inline key_type key(int i) { return decode((entry_key_t)keys[i]); }
+
+    // A record that was never set sorts after every key.
+    inline int compare(int i, key_type key) {
+      if(keys[i] == NULL)
+        return 1;
+      return string_keys::compare(this->key(i), key);
+    }
+
+    inline bool equal(int i, key_type key) { return compare(i, key) == 0; }
+
+    inline void set(int i, key_type key, char *p) {
+      slices[i] = slice(key, prefix_len);
+      keys[i] = key.data;
+      ptrs[i] = p;
+    }
+
+    inline void move(int dst, int src) {
+      slices[dst] = slices[src];
+      keys[dst] = keys[src];
+      ptrs[dst] = ptrs[src];
+    }
+
+    inline void reslice(int num_entries) {
+      for(int i = 0; i < num_entries; i++)
+        slices[i] = slice(key(i), prefix_len);
+    }
+
+    // Shorten the prefix so that key, about to be inserted, shares it.
+    inline void prepare(key_type key, int num_entries) {
+      if(num_entries == 0) {
+        prefix_len = key.len;
+        return;
+      }
+      uint32_t n = common_prefix(key, this->key(0), prefix_len);
+      if(n < prefix_len) {
+        prefix_len = n;
+        reslice(num_entries);
+      }
+    }
+
+    // Recompute the prefix once the records were rewritten in bulk. The keys
+    // are sorted, so the first and the last one bound it.
+    inline void rebuild(int num_entries) {
+      if(num_entries == 0)
+        return;
+      prefix_len = common_prefix(key(0), key(num_entries - 1), UINT32_MAX);
+      reslice(num_entries);
+    }
+
+    // Index of the first of the num_entries keys that is greater than key.
+    // The prefix is compared once, then the slices; only equal slices need
+    // the full keys.
+    inline int rank(key_type key, int num_entries) {
+      if(num_entries == 0)
+        return 0;
+      key_type first = this->key(0);
+      uint32_t n = prefix_len;
+      if(key.len < n)
+        n = key.len;
+      if(first.len < n)
+        n = first.len;
+      int c = memcmp(key.data, first.data, n);
+      if(c < 0 || (c == 0 && key.len < prefix_len))
+        return 0;
+      if(c > 0)
+        return num_entries;
+
+      uint64_t s = slice(key, prefix_len);
+      for(int i = 0; i < num_entries; i++)
+        if(slices[i] > s || (slices[i] == s && compare(i, key) > 0))
+          return i;
+      return num_entries;
+    }
+  };
 };
 
-class page;
+template<int NODE_SIZE, typename KEY = int_keys> class page_t;
 
-class btree{
+// Where a key would go in a leaf, as seen by one validated optimistic read.
+struct leaf_slot {
+  uint64_t version;
+  int pos;
+  int num_entries;
+};
+
+template<int NODE_SIZE, typename KEY = int_keys>
+class btree_t{
   private:
 
   public:
+    typedef page_t<NODE_SIZE, KEY> page;
+    typedef typename KEY::key_type key_type;
+
     int height;
     char* root;
+    int num_threads;
 
     list_node_t *list_head = NULL;
-    btree(int threadNum);
-    ~btree();
+    btree_t(int threadNum = 0, bool isRecover = false);
+    ~btree_t();
     void setNewRoot(char *);
-    void btree_insert_pred(entry_key_t, char*, char **pred, bool*);
-    void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
-    char *btree_search(entry_key_t);
-    char *btree_search_pred(entry_key_t, bool *f, char**, bool);
-    char *btree_search_pred_test(entry_key_t, bool *f, char**, bool, page**);
-    void insert(entry_key_t, char*); 
-    char* search(entry_key_t); 
-
-    friend class page;
+    void btree_insert_pred(key_type, char*, char **pred, bool*);
+    void btree_insert_internal(char *, key_type, char *, uint32_t);
+    char *btree_search(key_type);
+    char *btree_search_pred(key_type, bool *f, char**, bool debug = false);
+    char *btree_search_pred_test(key_type, bool *f, char**, bool debug = false, page** testPage = NULL,
+        leaf_slot *slot = NULL, page *start = NULL);
+    bool btree_delete_internal(key_type, char *, uint32_t);
+    void list_unlink(list_node_t *, list_node_t *);
+    void build_index(list_node_t **, long, double, int);
+    void recover(int);
+    bool bulk_load(key_type *, char **, long, double);
+    void insert(key_type, char*, uint64_t size = 0); 
+    void insert_batch(const key_type *, char **, long);
+    uint64_t insert_async(key_type, char*);
+    void wait_durable(uint64_t);
+    tree_stats stats();
+    bool remove(key_type);
+    char* search(key_type); 
+    void multi_get(const key_type *, long, char **);
+    void put(key_type, const char*, uint32_t);
+    int get(key_type, char*, uint32_t);
+    bool update(key_type, char*);
+    template<typename F> bool read_modify_write(key_type, F);
+    int scan(key_type, int, char**);
+
+    friend class page_t<NODE_SIZE, KEY>;
 };
 
 
+template<typename page>
 class header{
   private:
     page* leftmost_ptr;         
@@ -102,207 +514,315 @@ class header{
     uint8_t switch_counter;    
     uint8_t is_deleted;         
     int16_t last_index;        
-    std::mutex *mtx;            
+    uint64_t version;           // odd while a writer holds the page
 
-    friend class page;
-    friend class btree;
+    template<int, typename> friend class page_t;
+    template<int, typename> friend class btree_t;
 
   public:
     header() {
-      mtx = new std::mutex();
-
       leftmost_ptr = NULL;  
       sibling_ptr = NULL;
       pred_ptr = NULL;
       switch_counter = 0;
       last_index = -1;
       is_deleted = false;
+      version = 0;
     }
 
-    ~header() {
-      delete mtx;
+    inline void write_lock() {
+      uint64_t v;
+      while(true) {
+        v = __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+        if((v & 1) == 0 && CAS(&version, &v, v + 1))
+          return;
+        __builtin_ia32_pause();
+      }
     }
-};
 
-class entry{ 
-  private:
-    entry_key_t key; 
-    char* ptr; 
+    inline void write_unlock() {
+      __atomic_store_n(&version, version + 1, __ATOMIC_RELEASE);
+    }
+
+    // Readers take a snapshot of an unlocked version and retry the whole
+    // read if it changed by the time they are done.
+    inline uint64_t read_begin() {
+      uint64_t v;
+      while(((v = __atomic_load_n(&version, __ATOMIC_ACQUIRE)) & 1) != 0)
+        __builtin_ia32_pause();
+      return v;
+    }
 
-  public :
-    entry(){
-      key = LONG_MAX;
-      ptr = NULL;
+    inline bool read_validate(uint64_t v) {
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&version, __ATOMIC_RELAXED) == v)
+        return true;
+      STAT_INC(STAT_READ_RETRY);
+      return false;
     }
 
-    friend class page;
-    friend class btree;
+    // Take the lock only if nobody wrote since read_begin() returned v, so
+    // what was read can be acted on without reading it again.
+    inline bool try_write_lock(uint64_t v) {
+      return CAS(&version, &v, v + 1);
+    }
 };
 
-const int cardinality = (PAGESIZE-sizeof(header))/sizeof(entry);
+template<int NODE_SIZE, typename KEY>
+class page_t{
+  public:
+    typedef page_t<NODE_SIZE, KEY> page;
+    typedef btree_t<NODE_SIZE, KEY> btree;
+    typedef typename KEY::key_type key_type;
+
+    static constexpr int cardinality = (NODE_SIZE-sizeof(header<page>)-KEY::page_extra)/KEY::record_size;
+    static_assert(NODE_SIZE % CACHE_LINE_SIZE == 0, "node size must be a multiple of the cache line");
 
-class page{
   private:
-    header hdr;  
-    entry records[cardinality]; 
+    header<page> hdr;
+    typename KEY::template records<cardinality> records;
 
   public:
-    friend class btree;
+    friend class btree_t<NODE_SIZE, KEY>;
 
-    page(uint32_t level = 0) {
+    page_t(uint32_t level = 0) {
       hdr.level = level;
-      records[0].ptr = NULL;
+      records.ptr(0) = NULL;
     }
 
-    page(page* left, entry_key_t key, page* right, uint32_t level = 0) {
-      hdr.leftmost_ptr = left;  
+    page_t(page* left, key_type key, page* right, uint32_t level = 0) {
+      hdr.leftmost_ptr = left;
       hdr.level = level;
-      records[0].key = key;
-      records[0].ptr = (char*) right;
-      records[1].ptr = NULL;
+      records.prepare(key, 0);
+      records.set(0, key, (char*) right);
+      records.ptr(1) = NULL;
 
       hdr.last_index = 0;
     }
 
+    // The separators of an inner page are its own copies. Pages are only
+    // deleted once no reader can reach them.
+    ~page_t() {
+      if(hdr.level > 0)
+        for(int i = 0; i <= hdr.last_index; i++)
+          KEY::release_separator(records.key(i));
+    }
+
+    // Pages come from a per-thread arena of cache line aligned slots, so
+    // splits do not go through malloc and a thread's pages stay together.
+    static CLSlabPool &arena() {
+      thread_local CLSlabPool pool((sizeof(page) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+      return pool;
+    }
+
     void *operator new(size_t size) {
-      void *ret;
-      posix_memalign(&ret,64,size);
-      return ret;
+      return arena().Allocate();
+    }
+
+    void operator delete(void *p) {
+      arena().Free(p);
+    }
+
+    // Ask for every line of the page ahead of visiting it.
+    inline void prefetch() {
+      for(size_t off = 0; off < sizeof(page); off += CACHE_LINE_SIZE)
+        __builtin_prefetch((char *)this + off);
+    }
+
+    // Last record of the nearest non-empty page to the left, NULL if there is
+    // none (i.e. the predecessor is list_head).
+    inline char *pred_last() {
+      page *p = hdr.pred_ptr;
+      while(p != NULL) {
+        uint64_t v = p->hdr.read_begin();
+        int cnt = p->count();
+        char *last = (cnt > 0) ? p->records.ptr(cnt - 1) : NULL;
+        page *pred = p->hdr.pred_ptr;
+        if(!p->hdr.read_validate(v))
+          continue;
+        if(cnt > 0)
+          return last;
+        p = pred;
+      }
+      return NULL;
+    }
+
+    // Number of the first num_entries keys that are <= key, i.e. the index of
+    // the first greater key. Callers hold the lock or validate the version.
+    inline int rank(key_type key, int num_entries) {
+      return records.rank(key, num_entries);
+    }
+
+    // Whether key belongs to the right sibling. The sibling is read without
+    // taking its lock.
+    inline bool in_sibling(key_type key) {
+      return hdr.sibling_ptr != NULL && hdr.sibling_ptr->records.compare(0, key) <= 0;
+    }
+
+    // Whether key is below the last record of this page, or there is no page
+    // to the right: then it is in range if some key not above it is. Unlike
+    // in_sibling() this does not depend on the sibling's first record, which
+    // may be larger than the bound in the parent once it was removed.
+    inline bool covers(key_type key) {
+      while(true) {
+        uint64_t v = hdr.read_begin();
+        int cnt = count();
+        bool ret = hdr.sibling_ptr == NULL || (cnt > 0 && records.compare(cnt - 1, key) > 0);
+        if(hdr.read_validate(v))
+          return ret;
+      }
+    }
+
+    // Records the page can still take without splitting.
+    inline int room() {
+      while(true) {
+        uint64_t v = hdr.read_begin();
+        int ret = cardinality - 1 - count();
+        if(hdr.read_validate(v))
+          return ret;
+      }
     }
 
+    // Callers either hold the page lock or validate the page version.
     inline int count() {
-      uint8_t previous_switch_counter;
-      int count = 0;
-      do {
-        previous_switch_counter = hdr.switch_counter;
-        count = hdr.last_index + 1;
+      int count = hdr.last_index + 1;
 
-        while(count >= 0 && records[count].ptr != NULL) {
-          if(IS_FORWARD(previous_switch_counter))
-            ++count;
-          else
-            --count;
-        } 
+      while(count >= 0 && records.ptr(count) != NULL) {
+        STAT_INC(STAT_COUNT_REREAD);
+        if(IS_FORWARD(hdr.switch_counter))
+          ++count;
+        else
+          --count;
+      }
 
-        if(count < 0) {
-          count = 0;
-          while(records[count].ptr != NULL) {
-            ++count;
-          }
+      if(count < 0) {
+        count = 0;
+        while(records.ptr(count) != NULL) {
+          ++count;
         }
-
-      } while(previous_switch_counter != hdr.switch_counter);
+      }
 
       return count;
     }
 
-    inline void insert_key(entry_key_t key, char* ptr, int *num_entries, bool flush = true,
+    // Shift the greater records right and put (key, ptr) in the gap. With
+    // pred given, also report the list node in front of the new key.
+    inline void insert_key(key_type key, char* ptr, int *num_entries, char **pred = NULL,
         bool update_last_index = true) {
-          // update switch_counter
-          if(!IS_FORWARD(hdr.switch_counter))
-            ++hdr.switch_counter;
-
-          // FAST
-          if(*num_entries == 0) {  // this page is empty
-            entry* new_entry = (entry*) &records[0];
-            entry* array_end = (entry*) &records[1];
-            new_entry->key = (entry_key_t) key;
-            new_entry->ptr = (char*) ptr;
+      insert_key_at(rank(key, *num_entries), key, ptr, num_entries, pred, update_last_index);
+    }
 
-            array_end->ptr = (char*)NULL;
+    inline void insert_key_at(int pos, key_type key, char* ptr, int *num_entries, char **pred = NULL,
+        bool update_last_index = true) {
+      if(!IS_FORWARD(hdr.switch_counter))
+        ++hdr.switch_counter;
+
+      records.prepare(key, *num_entries);
+      records.ptr(*num_entries + 1) = NULL;
+      for(int i = *num_entries; i > pos; i--)
+        records.move(i, i - 1);
+      records.set(pos, key, ptr);
+
+      if(pred != NULL) {
+        if(pos > 0)
+          *pred = records.ptr(pos - 1);
+        else if(hdr.pred_ptr != NULL)
+          *pred = pred_last();
+      }
 
-          }
-          else {
-            int i = *num_entries - 1, inserted = 0;
-            records[*num_entries+1].ptr = records[*num_entries].ptr; 
-          
-
-          // FAST
-          for(i = *num_entries - 1; i >= 0; i--) {
-            if(key < records[i].key ) {
-              records[i+1].ptr = records[i].ptr;
-              records[i+1].key = records[i].key;
-            }
-            else{
-              records[i+1].ptr = records[i].ptr;
-              records[i+1].key = key;
-              records[i+1].ptr = ptr;
-              inserted = 1;
-              break;
-            }
-          }
-          if(inserted==0){
-            records[0].ptr =(char*) hdr.leftmost_ptr;
-            records[0].key = key;
-            records[0].ptr = ptr;
-          }
-        }
+      if(update_last_index) {
+        hdr.last_index = *num_entries;
+      }
+      ++(*num_entries);
+    }
 
-        if(update_last_index) {
-          hdr.last_index = *num_entries;
-        }
-        ++(*num_entries);
+    // Insert a key that was not in the page at the slot an optimistic read
+    // found for it. Fails, leaving the page alone, if the page was written
+    // since or has to split; store() then does the full work.
+    bool store_at(key_type key, char *ptr, const leaf_slot &slot) {
+      if(slot.num_entries >= cardinality - 1)
+        return false;
+      if(!hdr.try_write_lock(slot.version)) {
+        STAT_INC(STAT_SLOT_MISS);
+        return false;
       }
+      if(in_sibling(key)) {
+        hdr.write_unlock();
+        STAT_INC(STAT_SLOT_MISS);
+        return false;
+      }
+      int num_entries = slot.num_entries;
+      insert_key_at(slot.pos, key, ptr, &num_entries);
+      hdr.write_unlock();
+      return true;
+    }
 
-    page *store(btree* bt, char* left, entry_key_t key, char* right,
-       bool flush, bool with_lock, page *invalid_sibling = NULL) {
+    // Without pred an existing key gets its pointer replaced. With pred it is
+    // left alone: *pred is set to its record and NULL returned. NULL with
+    // *pred untouched means this page was detached.
+    page *store(btree* bt, char* left, key_type key, char* right,
+       bool flush, bool with_lock, char **pred = NULL, page *invalid_sibling = NULL) {
         if(with_lock) {
-          hdr.mtx->lock(); 
+          hdr.write_lock();
         }
         if(hdr.is_deleted) {
           if(with_lock) {
-            hdr.mtx->unlock();
+            hdr.write_unlock();
           }
-
           return NULL;
         }
 
         register int num_entries = count();
+        int pos = rank(key, num_entries);
 
-        for (int i = 0; i < num_entries; i++)
-          if (key == records[i].key) {
-            records[i].ptr = right;
-            if (with_lock)
-              hdr.mtx->unlock();
-            return this;
-          }
+        if (pos > 0 && records.equal(pos - 1, key)) {
+          if (pred != NULL)
+            *pred = records.ptr(pos - 1);
+          else
+            records.ptr(pos - 1) = right;
+          if (with_lock)
+            hdr.write_unlock();
+          return (pred != NULL) ? NULL : this;
+        }
 
-        if(hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
-          if(key > hdr.sibling_ptr->records[0].key) {
-            if(with_lock) { 
-              hdr.mtx->unlock();
-            }
-            return hdr.sibling_ptr->store(bt, NULL, key, right, 
-                true, with_lock, invalid_sibling);
+        if(hdr.sibling_ptr != invalid_sibling && in_sibling(key)) {
+          if(with_lock) {
+            hdr.write_unlock();
           }
+          return hdr.sibling_ptr->store(bt, NULL, key, right,
+              true, with_lock, pred, invalid_sibling);
         }
 
         if(num_entries < cardinality - 1) {
-          insert_key(key, right, &num_entries, flush);
+          insert_key(key, right, &num_entries, pred);
 
           if(with_lock) {
-            hdr.mtx->unlock(); 
+            hdr.write_unlock();
           }
 
           return this;
         }
         else {
-          page* sibling = new page(hdr.level); 
+          STAT_INC(STAT_SPLIT);
+          page* sibling = new page(hdr.level);
           register int m = (int) ceil(num_entries/2);
-          entry_key_t split_key = records[m].key;
+          key_type split_key = records.key(m);
+          if(hdr.leftmost_ptr == NULL)
+            split_key = KEY::separator(split_key);
 
           int sibling_cnt = 0;
           if(hdr.leftmost_ptr == NULL){
-            for(int i=m; i<num_entries; ++i){ 
-              sibling->insert_key(records[i].key, records[i].ptr, &sibling_cnt, false);
-            }
+            for(int i=m; i<num_entries; ++i, ++sibling_cnt)
+              sibling->records.set(sibling_cnt, records.key(i), records.ptr(i));
           }
-          else{ 
-            for(int i=m+1;i<num_entries;++i){ 
-              sibling->insert_key(records[i].key, records[i].ptr, &sibling_cnt, false);
-            }
-            sibling->hdr.leftmost_ptr = (page*) records[m].ptr;
+          else{
+            for(int i=m+1; i<num_entries; ++i, ++sibling_cnt)
+              sibling->records.set(sibling_cnt, records.key(i), records.ptr(i));
+            sibling->hdr.leftmost_ptr = (page*) records.ptr(m);
           }
+          sibling->records.ptr(sibling_cnt) = NULL;
+          sibling->records.rebuild(sibling_cnt);
+          sibling->hdr.last_index = sibling_cnt - 1;
 
           sibling->hdr.sibling_ptr = hdr.sibling_ptr;
           sibling->hdr.pred_ptr = this;
@@ -314,35 +834,36 @@ class page{
             hdr.switch_counter += 2;
           else
             ++hdr.switch_counter;
-          records[m].ptr = NULL;
+          records.ptr(m) = NULL;
+          records.rebuild(m);
           hdr.last_index = m - 1;
           num_entries = hdr.last_index + 1;
 
           page *ret;
 
-          if(key < split_key) {
-            insert_key(key, right, &num_entries);
+          if(pos <= m) {  // key < split_key
+            insert_key(key, right, &num_entries, pred);
             ret = this;
           }
           else {
-            sibling->insert_key(key, right, &sibling_cnt);
+            sibling->insert_key(key, right, &sibling_cnt, pred);
             ret = sibling;
           }
 
-          if(bt->root == (char *)this) { 
-            page* new_root = new page((page*)this, split_key, sibling, 
+          if(bt->root == (char *)this) {
+            page* new_root = new page((page*)this, split_key, sibling,
                 hdr.level + 1);
             bt->setNewRoot((char *)new_root);
 
             if(with_lock) {
-              hdr.mtx->unlock(); 
+              hdr.write_unlock();
             }
           }
           else {
             if(with_lock) {
-              hdr.mtx->unlock(); 
+              hdr.write_unlock();
             }
-            bt->btree_insert_internal(NULL, split_key, (char *)sibling, 
+            bt->btree_insert_internal(NULL, split_key, (char *)sibling,
                 hdr.level + 1);
           }
 
@@ -351,462 +872,214 @@ class page{
 
       }
 
-    inline void insert_key(entry_key_t key, char* ptr, int *num_entries, char **pred, bool flush = true,
-          bool update_last_index = true) {
-        if(!IS_FORWARD(hdr.switch_counter))
-          ++hdr.switch_counter;
-
-        if(*num_entries == 0) {  
-          entry* new_entry = (entry*) &records[0];
-          entry* array_end = (entry*) &records[1];
-          new_entry->key = (entry_key_t) key;
-          new_entry->ptr = (char*) ptr;
-
-          array_end->ptr = (char*)NULL;
+    // Put keys[0..k), sorted and all new to this page, in with one lock and
+    // one pass from the back. keys[0] must route here, the others must be
+    // covered. False, with the page untouched, if it was detached, has no
+    // room for them or they are no longer all in range.
+    bool store_batch(key_type *keys, char **ptrs, int k) {
+      hdr.write_lock();
+      int num_entries = count();
+      if(hdr.is_deleted || num_entries + k >= cardinality || in_sibling(keys[k - 1])
+          || (k > 1 && hdr.sibling_ptr != NULL
+            && (num_entries == 0 || records.compare(num_entries - 1, keys[k - 1]) < 0))) {
+        hdr.write_unlock();
+        return false;
+      }
 
-          if (hdr.pred_ptr != NULL)
-            *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
-        }
+      if(!IS_FORWARD(hdr.switch_counter))
+        ++hdr.switch_counter;
+      records.ptr(num_entries + k) = NULL;
+      int i = num_entries - 1;
+      for(int j = k - 1, dst = num_entries + k - 1; j >= 0; dst--) {
+        if(i >= 0 && records.compare(i, keys[j]) > 0)
+          records.move(dst, i--);
         else {
-          int i = *num_entries - 1, inserted = 0;
-          records[*num_entries+1].ptr = records[*num_entries].ptr; 
-          
-          for(i = *num_entries - 1; i >= 0; i--) {
-            if(key < records[i].key ) {
-              records[i+1].ptr = records[i].ptr;
-              records[i+1].key = records[i].key;
-            }
-            else{
-              records[i+1].ptr = records[i].ptr;
-              records[i+1].key = key;
-              records[i+1].ptr = ptr;
-              *pred = records[i].ptr;
-              inserted = 1;
-              break;
-            }
-          }
-          if(inserted==0){
-            records[0].ptr =(char*) hdr.leftmost_ptr;
-            records[0].key = key;
-            records[0].ptr = ptr;
-            if (hdr.pred_ptr != NULL)
-              *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
-          }
+          records.set(dst, keys[j], ptrs[j]);
+          j--;
         }
-
-        if(update_last_index) {
-          hdr.last_index = *num_entries;
-        }
-        ++(*num_entries);
       }
+      records.rebuild(num_entries + k);
+      hdr.last_index = num_entries + k - 1;
 
-    page *store(btree* bt, char* left, entry_key_t key, char* right,
-       bool flush, bool with_lock, char **pred, page *invalid_sibling = NULL) {
-        if(with_lock) {
-          hdr.mtx->lock(); 
-        }
-        if(hdr.is_deleted) {
-          if(with_lock) {
-            hdr.mtx->unlock();
-          }
-          return NULL;
-        }
-
-        register int num_entries = count();
-
-        for (int i = 0; i < num_entries; i++)
-          if (key == records[i].key) {
-            *pred = records[i].ptr;
-            if (with_lock)
-              hdr.mtx->unlock();
-            return NULL;
-          }
-
-        if(hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
-          if(key > hdr.sibling_ptr->records[0].key) {
-            if(with_lock) { 
-              hdr.mtx->unlock();
-            }
-            return hdr.sibling_ptr->store(bt, NULL, key, right, 
-                true, with_lock, pred, invalid_sibling);
-          }
-        }
-
-        if(num_entries < cardinality - 1) {
-          insert_key(key, right, &num_entries, pred);
-
-          if(with_lock) {
-            hdr.mtx->unlock(); 
-          }
-
-          return this;
-        }else {
-          page* sibling = new page(hdr.level); 
-          register int m = (int) ceil(num_entries/2);
-          entry_key_t split_key = records[m].key;
+      hdr.write_unlock();
+      return true;
+    }
 
-          int sibling_cnt = 0;
-          if(hdr.leftmost_ptr == NULL){ 
-            for(int i=m; i<num_entries; ++i){ 
-              sibling->insert_key(records[i].key, records[i].ptr, &sibling_cnt, false);
-            }
-          }
-          else{ 
-            for(int i=m+1;i<num_entries;++i){ 
-              sibling->insert_key(records[i].key, records[i].ptr, &sibling_cnt, false);
-            }
-            sibling->hdr.leftmost_ptr = (page*) records[m].ptr; 
-          }
+    inline bool remove_key(key_type key) {
+      int num_entries = count();
+      int pos = rank(key, num_entries) - 1;
+      if(pos < 0 || !records.equal(pos, key))
+        return false;
 
-          sibling->hdr.sibling_ptr = hdr.sibling_ptr;
-          sibling->hdr.pred_ptr = this;
-          if (sibling->hdr.sibling_ptr != NULL)
-            sibling->hdr.sibling_ptr->hdr.pred_ptr = sibling;
-          hdr.sibling_ptr = sibling;
+      // update switch_counter
+      if(IS_FORWARD(hdr.switch_counter))
+        ++hdr.switch_counter;
 
-          if(IS_FORWARD(hdr.switch_counter))
-            hdr.switch_counter += 2;
-          else
-            ++hdr.switch_counter;
-          records[m].ptr = NULL;
-          hdr.last_index = m - 1;
-          num_entries = hdr.last_index + 1;
-
-          page *ret;
+      for(int i = pos; i < num_entries; i++)
+        records.move(i, i + 1);
 
-          if(key < split_key) {
-            insert_key(key, right, &num_entries, pred);
-            ret = this;
-          }
-          else {
-            sibling->insert_key(key, right, &sibling_cnt, pred);
-            ret = sibling;
-          }
-
-          if(bt->root == (char *)this) { 
-            page* new_root = new page((page*)this, split_key, sibling, 
-                hdr.level + 1);
-            bt->setNewRoot((char *)new_root);
-
-            if(with_lock) {
-              hdr.mtx->unlock(); 
-            }
-          }
-          else {
-            if(with_lock) {
-              hdr.mtx->unlock(); 
-            }
-            bt->btree_insert_internal(NULL, split_key, (char *)sibling, 
-                hdr.level + 1);
-          }
+      --hdr.last_index;
+      return true;
+    }
 
-          return ret;
-        }
+    // Drop the routing entry for child. If child is the leftmost pointer its
+    // right neighbour takes over the range. Returns 1 on success, 0 if child
+    // is not referenced here and -1 if this page would lose its last child.
+    int remove_child(char *child) {
+      int num_entries = count();
 
+      if((char *)hdr.leftmost_ptr == child) {
+        if(num_entries == 0)
+          return -1;
+        if(IS_FORWARD(hdr.switch_counter))
+          ++hdr.switch_counter;
+        hdr.leftmost_ptr = (page *)records.ptr(0);
+        key_type key = records.key(0);
+        remove_key(key);
+        KEY::retire_separator(key);
+        return 1;
       }
 
-    char *linear_search(entry_key_t key) {
-      int i = 1;
-      uint8_t previous_switch_counter;
-      char *ret = NULL;
-      char *t; 
-      entry_key_t k;
-
-      if(hdr.leftmost_ptr == NULL) { 
-        do {
-          previous_switch_counter = hdr.switch_counter;
-          ret = NULL;
-
-          if(IS_FORWARD(previous_switch_counter)) { 
-            if((k = records[0].key) == key) { 
-              if((t = records[0].ptr) != NULL) {
-                if(k == records[0].key) {
-                  ret = t;
-                  continue;
-                }
-              }
-            }
-
-            for(i=1; records[i].ptr != NULL; ++i) { 
-              if((k = records[i].key) == key) {
-                if(records[i-1].ptr != (t = records[i].ptr)) {
-                  if(k == records[i].key) {
-                    ret = t;
-                    break;
-                  }
-                }
-              }
-            }
-          }
-          else { 
-            for(i = count() - 1; i > 0; --i) {
-              if((k = records[i].key) == key) {
-                if(records[i - 1].ptr != (t = records[i].ptr) && t) {
-                  if(k == records[i].key) {
-                    ret = t;
-                    break;
-                  }
-                }
-              }
-            }
-
-            if(!ret) {
-              if((k = records[0].key) == key) {
-                if(NULL != (t = records[0].ptr) && t) {
-                  if(k == records[0].key) {
-                    ret = t;
-                    continue;
-                  }
-                }
-              }
-            }
-          }
-        } while(hdr.switch_counter != previous_switch_counter);
-
-        if(ret) {
-          return ret;
+      for(int i = 0; i < num_entries; i++) {
+        if(records.ptr(i) == child) {
+          key_type key = records.key(i);
+          remove_key(key);
+          KEY::retire_separator(key);
+          return 1;
         }
-
-        if((t = (char *)hdr.sibling_ptr) && key >= ((page *)t)->records[0].key)
-          return t;
-
-        return NULL;
       }
-      else { 
-        do {
-          previous_switch_counter = hdr.switch_counter;
-          ret = NULL;
+      return 0;
+    }
 
-          if(IS_FORWARD(previous_switch_counter)) {
-            if(key < (k = records[0].key)) {
-              if((t = (char *)hdr.leftmost_ptr) != records[0].ptr) { 
-                ret = t;
-                continue;
-              }
-            }
+    // Remove key from this leaf, or from the sibling it moved to. Returns
+    // false if the page was detached meanwhile and the caller must descend
+    // again. An emptied page is unhooked from its parent and the leaf chain.
+    bool remove(btree *bt, key_type key) {
+      hdr.write_lock();
+      if(hdr.is_deleted) {
+        hdr.write_unlock();
+        return false;
+      }
 
-            for(i = 1; records[i].ptr != NULL; ++i) { 
-              if(key < (k = records[i].key)) { 
-                if((t = records[i-1].ptr) != records[i].ptr) {
-                  ret = t;
-                  break;
-                }
-              }
-            }
+      if(in_sibling(key)) {
+        hdr.write_unlock();
+        return hdr.sibling_ptr->remove(bt, key);
+      }
 
-            if(!ret) {
-              ret = records[i - 1].ptr; 
-              continue;
-            }
-          }
-          else {
-            for(i = count() - 1; i >= 0; --i) {
-              if(key >= (k = records[i].key)) {
-                if(i == 0) {
-                  if((char *)hdr.leftmost_ptr != (t = records[i].ptr)) {
-                    ret = t;
-                    break;
-                  }
-                }
-                else {
-                  if(records[i - 1].ptr != (t = records[i].ptr)) {
-                    ret = t;
-                    break;
-                  }
-                }
-              }
-            }
-          }
-        } while(hdr.switch_counter != previous_switch_counter);
+      remove_key(key);
 
-        if((t = (char *)hdr.sibling_ptr) != NULL) {
-          if(key >= ((page *)t)->records[0].key)
-            return t;
-        }
+      if(count() == 0 && hdr.pred_ptr != NULL && bt->root != (char *)this
+          && bt->btree_delete_internal(key, (char *)this, hdr.level + 1)) {
+        hdr.is_deleted = true;
 
-        if(ret) {
-          return ret;
+        page *pred;
+        while(true) {
+          pred = hdr.pred_ptr;
+          pred->hdr.write_lock();
+          if(!pred->hdr.is_deleted && pred->hdr.sibling_ptr == this)
+            break;
+          pred->hdr.write_unlock();
         }
-        else
-          return (char *)hdr.leftmost_ptr;
+        pred->hdr.sibling_ptr = hdr.sibling_ptr;
+        if(hdr.sibling_ptr != NULL)
+          hdr.sibling_ptr->hdr.pred_ptr = pred;
+        pred->hdr.write_unlock();
+
+        hdr.write_unlock();
+        epochManager->retire(this, [](void *p) { delete (page *)p; });
+        return true;
       }
 
-      return NULL;
+      hdr.write_unlock();
+      return true;
     }
 
-    char *linear_search_pred(entry_key_t key, char **pred, bool debug=false) {
-      int i = 1;
-      uint8_t previous_switch_counter;
+    // Readers run on a validated snapshot of the page, so a single rank over
+    // the sorted keys replaces the FAST&FAIR duplicate pointer checks.
+    char *linear_search(key_type key) {
       char *ret = NULL;
-      char *t; 
-      entry_key_t k, k1;
-
-      if(hdr.leftmost_ptr == NULL) { 
-        do {
-          previous_switch_counter = hdr.switch_counter;
-          ret = NULL;
-
-          if(IS_FORWARD(previous_switch_counter)) {
-            k = records[0].key;
-            if (key < k) {
-              if (hdr.pred_ptr != NULL){
-                *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
-              }
-            }
-            if (key > k){
-              *pred = records[0].ptr;
-            }
-              
-
-            if(k == key) {
-              if (hdr.pred_ptr != NULL) {
-                *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
-              }
-              if((t = records[0].ptr) != NULL) {
-                if(k == records[0].key) {
-                  ret = t;
-                  continue;
-                }
-              }
-            }
+      uint64_t v;
+      int pos;
 
-            for(i=1; records[i].ptr != NULL; ++i) { 
-              k = records[i].key;
-              if (k < key){
-                *pred = records[i].ptr;
-              }
-              if(k == key) {
-                if(records[i-1].ptr != (t = records[i].ptr)) {
-                  if(k == records[i].key) {
-                    ret = t;
-                    break;
-                  }
-                }
-              }
-            }
-          }else { 
-            bool once = true;
-            
-            if(records[count()-1].key < key){
-              *pred = records[count()-1].ptr;
-              once = false;
-            }
-
-            for (i = count() - 1; i > 0; --i) {
-              k = records[i].key;
-              k1 = records[i - 1].key;
-              if (k1 < key && once) {
-                *pred = records[i - 1].ptr;
-                once = false;
-              }
-              if(k == key) {
-                if(records[i - 1].ptr != (t = records[i].ptr) && t) {
-                  if(k == records[i].key) {
-                    ret = t;
-                    break;
-                  }
-                }
-              }
-            }
-
-            if(!ret) {
-              k = records[0].key;
-              if (key < k){
-                if (hdr.pred_ptr != NULL){
-                  *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
-                }
-              }
-              if (key > k && once)
-                *pred = records[0].ptr;
-              if(k == key) {
-                if (hdr.pred_ptr != NULL) {
-                  *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
-                }
-                if(NULL != (t = records[0].ptr) && t) {
-                  if(k == records[0].key) {
-                    ret = t;
-                    continue;
-                  }
-                }
-              }
-            }
-          }
-        } while(hdr.switch_counter != previous_switch_counter);
+      do {
+        v = hdr.read_begin();
+        pos = rank(key, count());
 
-        if(ret) {
-          return ret;
-        }
+        if(hdr.leftmost_ptr == NULL)
+          ret = (pos > 0 && records.equal(pos - 1, key)) ? records.ptr(pos - 1) : NULL;
+        else
+          ret = (pos > 0) ? records.ptr(pos - 1) : (char *)hdr.leftmost_ptr;
+      } while(!hdr.read_validate(v));
 
-        if((t = (char *)hdr.sibling_ptr) && key >= ((page *)t)->records[0].key)
-          return t;
+      if(hdr.leftmost_ptr == NULL && ret)
+        return ret;
 
-        return NULL;
+      if(in_sibling(key)) {
+        STAT_INC(STAT_SIBLING_CHASE);
+        return (char *)hdr.sibling_ptr;
       }
-      else { 
-        do {
-          previous_switch_counter = hdr.switch_counter;
-          ret = NULL;
 
-          if(IS_FORWARD(previous_switch_counter)) {
-            if(key < (k = records[0].key)) {
-              if((t = (char *)hdr.leftmost_ptr) != records[0].ptr) { 
-                ret = t;
-                continue;
-              }
-            }
+      return ret;
+    }
 
-            for(i = 1; records[i].ptr != NULL; ++i) { 
-              if(key < (k = records[i].key)) { 
-                if((t = records[i-1].ptr) != records[i].ptr) {
-                  ret = t;
-                  break;
-                }
-              }
-            }
+    // With slot given, also note where key would be inserted.
+    char *linear_search_pred(key_type key, char **pred, bool debug=false, leaf_slot *slot = NULL) {
+      if(hdr.leftmost_ptr != NULL)
+        return linear_search(key);
 
-            if(!ret) {
-              ret = records[i - 1].ptr; 
-              continue;
-            }
-          }
-          else {
-            for(i = count() - 1; i >= 0; --i) {
-              if(key >= (k = records[i].key)) {
-                if(i == 0) {
-                  if((char *)hdr.leftmost_ptr != (t = records[i].ptr)) {
-                    ret = t;
-                    break;
-                  }
-                }
-                else {
-                  if(records[i - 1].ptr != (t = records[i].ptr)) {
-                    ret = t;
-                    break;
-                  }
-                }
-              }
-            }
-          }
-        } while(hdr.switch_counter != previous_switch_counter);
+      char *ret = NULL;
+      uint64_t v;
+      int pos, pred_pos, num_entries;
 
-        if((t = (char *)hdr.sibling_ptr) != NULL) {
-          if(key >= ((page *)t)->records[0].key)
-            return t;
+      do {
+        v = hdr.read_begin();
+        ret = NULL;
+        num_entries = count();
+        pos = rank(key, num_entries);
+        pred_pos = pos - 1;
+
+        if(pos > 0 && records.equal(pos - 1, key)) {
+          ret = records.ptr(pos - 1);
+          --pred_pos;
         }
 
-        if(ret) {
-          return ret;
-        }
-        else
-          return (char *)hdr.leftmost_ptr;
+        // predecessor: last key < key here, else the tail of the pages to
+        // the left
+        if(pred_pos >= 0)
+          *pred = records.ptr(pred_pos);
+        else if(hdr.pred_ptr != NULL)
+          *pred = pred_last();
+      } while(!hdr.read_validate(v));
+
+      if(slot != NULL) {
+        slot->version = v;
+        slot->pos = pos;
+        slot->num_entries = num_entries;
+      }
+
+      if(ret)
+        return ret;
+
+      if(in_sibling(key)) {
+        STAT_INC(STAT_SIBLING_CHASE);
+        return (char *)hdr.sibling_ptr;
       }
 
       return NULL;
     }
 };
 
-btree::btree(int threadNum = 0){
-  initializeMemoryPool(threadNum+1);
+template<int NODE_SIZE, typename KEY>
+btree_t<NODE_SIZE, KEY>::btree_t(int threadNum, bool isRecover){
+  initializeMemoryPool(threadNum+1, isRecover);
+  num_threads = threadNum+1;
+
+  if(isRecover){
+    // list_head is the first allocation in the region
+    list_head = (list_node_t *)pmAllocator->m_buf;
+    recover(threadNum+1);
+    return;
+  }
 
   root = (char*)new page();
   list_head = (list_node_t *)alloc(sizeof(list_node_t));
@@ -814,29 +1087,43 @@ btree::btree(int threadNum = 0){
   height = 1; 
 }
 
-btree::~btree() { 
+// Run fn(t) for t in [0, workers), each on its own thread.
+template<typename F>
+static void run_parallel(int workers, F fn) {
+  vector<thread> threads;
+  for(int t = 0; t < workers; t++)
+    threads.emplace_back(fn, t);
+  for(auto &th : threads)
+    th.join();
+}
+
+template<int NODE_SIZE, typename KEY>
+btree_t<NODE_SIZE, KEY>::~btree_t() { 
 
 }
 
-void btree::setNewRoot(char *new_root) {
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::setNewRoot(char *new_root) {
   this->root = (char*)new_root;
   ++height;
 }
 
-char *btree::btree_search_pred(entry_key_t key, bool *f, char **prev, bool debug=false){
-  page* p = (page*)root;
+template<int NODE_SIZE, typename KEY>
+char *btree_t<NODE_SIZE, KEY>::btree_search_pred(key_type key, bool *f, char **prev, bool debug){
+  page *p, *t;
 
-  while(p->hdr.leftmost_ptr != NULL) {
-    p = (page *)p->linear_search(key);
-  }
+  do {
+    p = (page*)root;
+    *prev = NULL;
 
-  page *t;
-  while((t = (page *)p->linear_search_pred(key, prev, debug)) == p->hdr.sibling_ptr) {
-    p = t;
-    if(!p) {
-      break;
+    while(p->hdr.leftmost_ptr != NULL) {
+      p = (page *)p->linear_search(key);
     }
-  }
+
+    while((t = (page *)p->linear_search_pred(key, prev, debug)) == p->hdr.sibling_ptr && t != NULL) {
+      p = t;
+    }
+  } while(t == NULL && p->hdr.is_deleted);
 
   if(!t) {
     *f = false;
@@ -847,23 +1134,32 @@ char *btree::btree_search_pred(entry_key_t key, bool *f, char **prev, bool debug
   return (char *)t;
 }
 
-char *btree::btree_search_pred_test(entry_key_t key, bool *f, char **prev, bool debug=false, page** testPage=NULL){
-  page* p = (page*)root;
-
-  while(p->hdr.leftmost_ptr != NULL) {
-    p = (page *)p->linear_search(key);
-  }
-
-  *testPage = (page*)p;
+// A leaf's range only grows to the left (when its left neighbour is
+// unhooked) and shrinks to the right (by splits, which the sibling walk
+// follows), so a search for a key that once led to leaf start may begin
+// there as long as start is still linked.
+template<int NODE_SIZE, typename KEY>
+char *btree_t<NODE_SIZE, KEY>::btree_search_pred_test(key_type key, bool *f, char **prev, bool debug, page** testPage,
+    leaf_slot *slot, page *start){
+  page *p, *t;
+
+  do {
+    p = (page*)root;
+    *prev = NULL;
+
+    if(start != NULL && !start->hdr.is_deleted)
+      p = start;
+    start = NULL;
+    while(p->hdr.leftmost_ptr != NULL) {
+      p = (page *)p->linear_search(key);
+    }
 
-  page *t;
-  while((t = (page *)p->linear_search_pred(key, prev, debug)) == p->hdr.sibling_ptr) {
-    *testPage = (page*)p;
-    p = t;
-    if(!p) {
-      break;
+    while((t = (page *)p->linear_search_pred(key, prev, debug, slot)) == p->hdr.sibling_ptr && t != NULL) {
+      p = t;
     }
-  }
+  } while(t == NULL && p->hdr.is_deleted);
+
+  *testPage = p;
 
   if(!t) {
     *f = false;
@@ -874,60 +1170,286 @@ char *btree::btree_search_pred_test(entry_key_t key, bool *f, char **prev, bool
   return (char *)t;
 }
 
-char *btree::search(entry_key_t key) {
+template<int NODE_SIZE, typename KEY>
+char *btree_t<NODE_SIZE, KEY>::search(key_type key) {
+  CLEpochGuard guard;
   bool f = false;
   char *prev;
   char *ptr = btree_search_pred(key, &f, &prev);
   if (f) {
     list_node_t *n = (list_node_t *)ptr;
-    if (n->ptr != 0)
+    if (n->ptr != 0 && (__atomic_load_n(&(n->next), __ATOMIC_ACQUIRE) & deletedSet) == 0)
       return (char *)n->ptr; 
   }
   return NULL;
 }
 
-void btree::btree_insert_pred(entry_key_t key, char* right, char **pred, bool *update){ 
-  page* p = (page*)root;
+// out[i] = search(keys[i]) for n keys. Up to MULTIGET_GROUP lookups are
+// interleaved: a step takes one lookup one page further and prefetches what
+// it needs next, so the cache misses of the group overlap instead of being
+// taken one after the other.
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::multi_get(const key_type *keys, long n, char **out) {
+  struct lookup {
+    long i;
+    page *p;
+    list_node_t *node;
+
+    inline void start(long index, char *root) {
+      i = index;
+      p = (page *)root;
+      node = NULL;
+      p->prefetch();
+    }
+  };
+
+  CLEpochGuard guard;
+  lookup group[MULTIGET_GROUP];
+  long next = 0;
+  int active = 0;
+  while(active < MULTIGET_GROUP && next < n)
+    group[active++].start(next++, root);
+
+  int g = 0;
+  while(active > 0) {
+    if(g >= active)
+      g = 0;
+    lookup &l = group[g];
+    key_type key = keys[l.i];
+    bool done = false;
+
+    if(l.node != NULL) {
+      list_node_t *node = l.node;
+      out[l.i] = (node->ptr != 0 && (__atomic_load_n(&(node->next), __ATOMIC_ACQUIRE) & deletedSet) == 0)
+        ? (char *)node->ptr : NULL;
+      done = true;
+    }
+    else if(l.p->hdr.leftmost_ptr != NULL) {
+      l.p = (page *)l.p->linear_search(key);
+      l.p->prefetch();
+    }
+    else {
+      // same walk as btree_search_pred(): follow siblings, restart from the
+      // root if the leaf went away
+      char *t = l.p->linear_search(key);
+      if(t != NULL && t == (char *)l.p->hdr.sibling_ptr) {
+        l.p = (page *)t;
+        l.p->prefetch();
+      }
+      else if(t != NULL) {
+        l.node = (list_node_t *)t;
+        __builtin_prefetch(t);
+      }
+      else if(l.p->hdr.is_deleted) {
+        l.start(l.i, root);
+      }
+      else {
+        out[l.i] = NULL;
+        done = true;
+      }
+    }
 
-  while(p->hdr.leftmost_ptr != NULL) { 
-    p = (page*)p->linear_search(key);
+    if(done) {
+      if(next < n) {
+        l.start(next++, root);
+      }
+      else {
+        // the last lookup takes this slot and is stepped next
+        l = group[--active];
+        continue;
+      }
+    }
+    g++;
+  }
+}
+
+// Replace the value of an existing key, false if there is none. Unlike
+// insert() this never touches the pages.
+template<int NODE_SIZE, typename KEY>
+bool btree_t<NODE_SIZE, KEY>::update(key_type key, char *value) {
+  return read_modify_write(key, [value](char *) { return value; });
+}
+
+// Replace the value of key by fn(old value), atomically with respect to
+// other updates of the key. False if the key is not there.
+template<int NODE_SIZE, typename KEY>
+template<typename F>
+bool btree_t<NODE_SIZE, KEY>::read_modify_write(key_type key, F fn) {
+  CLEpochGuard guard;
+  bool f = false;
+  char *prev;
+  list_node_t *n = (list_node_t *)btree_search_pred(key, &f, &prev);
+  if (!f)
+    return false;
+
+  n->acquireVersionLock();
+  if ((__atomic_load_n(&(n->next), __ATOMIC_ACQUIRE) & deletedSet) != 0) {
+    n->releaseVersion();
+    return false;
   }
-  *pred = NULL;
-  if(!p->store(this, NULL, key, right, true, true, pred)) {  
-    *update = true;
+  // a value written by put() is replaced by a plain pointer value
+  uint64_t oldPtr = n->ptr, oldSize = n->size;
+  n->ptr = (uint64_t)fn((char *)n->ptr);
+  n->size = 0;
+  persist((char*)n, sizeof(list_node_t));
+  n->releaseVersion();
+  retire_value(oldPtr, oldSize);
+  return true;
+}
+
+// Store len bytes of value under key, inserting the key if it is new.
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::put(key_type key, const char *value, uint32_t len) {
+  uint64_t ptr = 0, size = valueSet | len;
+  if (len <= sizeof(ptr)) {
+    memcpy(&ptr, value, len);
+    size |= inlineSet;
   } else {
-    *update = false;
+    char *blob = (char *)alloc(value_blob_size(len));
+    *(uint64_t *)blob = len;
+    memcpy(blob + sizeof(uint64_t), value, len);
+    persist(blob, sizeof(uint64_t) + len);
+    ptr = (uint64_t)blob;
+  }
+  insert(key, (char *)ptr, size);
+}
+
+// Copy up to cap bytes of key's value to buf and return its full length, -1
+// if the key is not there. A plain pointer value reads as its 8 bytes. The
+// copy is retried until the node's version shows no writer came by.
+template<int NODE_SIZE, typename KEY>
+int btree_t<NODE_SIZE, KEY>::get(key_type key, char *buf, uint32_t cap) {
+  CLEpochGuard guard;
+  bool f = false;
+  char *prev;
+  list_node_t *n = (list_node_t *)btree_search_pred(key, &f, &prev);
+  if (!f)
+    return -1;
+
+  while (true) {
+    uint64_t v = __atomic_load_n(&(n->next), __ATOMIC_ACQUIRE);
+    if ((v & deletedSet) != 0)
+      return -1;
+    if (((v & versionSet) >> 48) % 2 != 0)
+      continue;
+
+    uint64_t ptr = __atomic_load_n(&(n->ptr), __ATOMIC_RELAXED);
+    uint64_t size = __atomic_load_n(&(n->size), __ATOMIC_RELAXED);
+    // ptr and size must belong together before ptr is followed
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((__atomic_load_n(&(n->next), __ATOMIC_RELAXED) & versionSet) != (v & versionSet)) {
+      STAT_INC(STAT_READ_RETRY);
+      continue;
+    }
+    const char *src = (const char *)&ptr;
+    uint32_t len = sizeof(ptr);
+    if ((size & valueSet) != 0) {
+      len = size & valueLenSet;
+      if ((size & inlineSet) == 0)
+        src = (const char *)ptr + sizeof(uint64_t);
+    }
+    memcpy(buf, src, (len < cap) ? len : cap);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((__atomic_load_n(&(n->next), __ATOMIC_ACQUIRE) & versionSet) == (v & versionSet))
+      return (int)len;
+    STAT_INC(STAT_READ_RETRY);
+  }
+}
+
+// Collect up to count values with key >= start_key. The tree is only used to
+// locate the start position, the rest is a walk along the sorted list.
+template<int NODE_SIZE, typename KEY>
+int btree_t<NODE_SIZE, KEY>::scan(key_type start_key, int count, char **out) {
+  CLEpochGuard guard;
+  bool f = false;
+  char *prev = NULL;
+  list_node_t *n = (list_node_t *)btree_search_pred(start_key, &f, &prev);
+  if (!f) {
+    list_node_t *p = (prev != NULL) ? (list_node_t *)prev : list_head;
+    n = (list_node_t *)(__atomic_load_n(&(p->next), __ATOMIC_ACQUIRE) & ptrSet);
   }
+
+  int found = 0;
+  while (n != NULL && found < count) {
+    uint64_t next = __atomic_load_n(&(n->next), __ATOMIC_ACQUIRE);
+    if (KEY::compare(n->key, start_key) >= 0 && (next & deletedSet) == 0 && n->ptr != 0)
+      out[found++] = (char *)n->ptr;
+    n = (list_node_t *)(next & ptrSet);
+  }
+  return found;
+}
+
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::btree_insert_pred(key_type key, char* right, char **pred, bool *update){ 
+  page* p;
+
+  do {
+    p = (page*)root;
+    while(p->hdr.leftmost_ptr != NULL) { 
+      p = (page*)p->linear_search(key);
+    }
+    *pred = NULL;
+    if(p->store(this, NULL, key, right, true, true, pred)) {
+      *update = false;
+      return;
+    }
+    // NULL without a predecessor means we hit a detached page
+  } while(*pred == NULL);
+  *update = true;
 }
 
-void btree::insert(entry_key_t key, char *right) {
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::insert(key_type key, char *right, uint64_t size) {
   int retry = 0;
   bool hasFound;
   list_node_t *prev = NULL, *cur = NULL;
-  list_node_t *n;
+  list_node_t *n = NULL;
   page* testPage = NULL;
+  leaf_slot slot;
+  CLEpochGuard guard;
 retryinsert:
-  if(retry > 10){
-    return;
+  // an insert is never given up on; a retry backs off and starts over at
+  // the leaf of the previous attempt
+  if(retry > 0){
+    STAT_INC(STAT_INSERT_RETRY);
+    backoff(retry);
   }
 
-  // TODO
-  struct timeval start, end;
-  gettimeofday(&start, nullptr);
-  cur = (list_node_t*)btree_search_pred_test(key, &hasFound, (char**)&prev, false, &testPage);
-  gettimeofday(&end, nullptr);
-  t1 += (end.tv_sec + (double)(end.tv_usec) / 1000000) - (start.tv_sec + (double)(start.tv_usec) / 1000000);
-  
+  cur = (list_node_t*)btree_search_pred_test(key, &hasFound, (char**)&prev, false, &testPage, &slot,
+      (retry > 0) ? testPage : NULL);
+
   if(cur){
+    if((__atomic_load_n(&(cur->next), __ATOMIC_ACQUIRE) & deletedSet) != 0){
+      // being removed, wait for it to leave the leaf
+      retry++;
+      goto retryinsert;
+    }
     cur->acquireVersionLock();
+    if((__atomic_load_n(&(cur->next), __ATOMIC_ACQUIRE) & deletedSet) != 0){
+      cur->releaseVersion();
+      retry++;
+      goto retryinsert;
+    }
+    // someone else inserted the key after our node was allocated
+    if(n != NULL) {
+      KEY::release(n->key);
+      dealloc(n, sizeof(list_node_t));
+    }
+    uint64_t oldPtr = cur->ptr, oldSize = cur->size;
     cur->ptr = (uint64_t)right;
-    persist((char*)cur, sizeof(list_node_t));
+    cur->size = size;
+    persist((char*)cur, sizeof(list_node_t), true);
     cur->releaseVersion();
+    retire_value(oldPtr, oldSize);
   }else{
-    if(retry == 0){
+    if(n == NULL){
       n = (list_node_t *)alloc(sizeof(list_node_t));
       n->next = NULL;
-      n->key = key;
+      n->size = size;
+      n->key = KEY::encode(key);
+      // pages keep the list node's copy of the key
+      key = KEY::decode(n->key);
       n->ptr = (uint64_t)right;
     }
     if(list_head->next != NULL){
@@ -944,17 +1466,29 @@ retryinsert:
       uint64_t oldValue = (uint64_t)next;
       next = (list_node_t*)((uint64_t)next & ptrSet);
 
-      if((prev == list_head || (prev != list_head && prev->key < key)) && (next == NULL || (next != NULL && next->key > key))){
+      if(next != NULL && (__atomic_load_n(&(next->next), __ATOMIC_ACQUIRE) & deletedSet) != 0){
+        // help the remover get the marked successor out of the way
+        list_unlink(prev, next);
+        retry++;
+        goto retryinsert;
+      }
+
+      if((prev == list_head || (prev != list_head && KEY::compare(prev->key, key) < 0)) && (next == NULL || (next != NULL && KEY::compare(next->key, key) > 0))){
         n->next = (uint64_t)next;
         persist((char*)n, sizeof(list_node_t));
-        if(!CAS(&(prev->next), &oldValue, n)){
+        // prev's version and lock bits are not ours to change
+        if(!CAS(&(prev->next), &oldValue, (oldValue & ~ptrSet) | (uint64_t)n)){
           retry++;
           goto retryinsert;
         }
 
-        persist((char*)prev, sizeof(list_node_t));
+        persist((char*)prev, sizeof(list_node_t), true);
+        // the leaf is usually as we read it and takes the key where we
+        // found its place
         prev = NULL;
-        testPage->store(this, nullptr, key, (char*)n, true, true, (char**)&prev);
+        if(!testPage->store_at(key, (char*)n, slot)
+            && !testPage->store(this, nullptr, key, (char*)n, true, true, (char**)&prev) && prev == NULL)
+          btree_insert_pred(key, (char*)n, (char**)&prev, &hasFound);
       }else{
         retry++;
         goto retryinsert;
@@ -969,7 +1503,168 @@ retryinsert:
   }
 }
 
-void btree::btree_insert_internal(char *left, entry_key_t key, char *right, uint32_t level) {
+// Insert n keys. The batch is sorted first (a later duplicate wins), then
+// taken leaf by leaf: one descent finds the leaf, the list is walked from
+// there to place the following keys. Keys that land between the same two
+// list nodes form a run whose nodes are chained up front and linked in with
+// one CAS. All runs of a leaf go into it under one lock; if it cannot take
+// them whole they are stored one by one.
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::insert_batch(const key_type *keys, char **values, long n) {
+  vector<long> order(n);
+  for(long i = 0; i < n; i++)
+    order[i] = i;
+  stable_sort(order.begin(), order.end(), [keys](long a, long b) {
+    return KEY::compare(keys[a], keys[b]) < 0;
+  });
+  vector<long> idx;
+  for(long i = 0; i < n; i++)
+    if(i + 1 == n || KEY::compare(keys[order[i]], keys[order[i + 1]]) != 0)
+      idx.push_back(order[i]);
+
+  CLEpochGuard guard;
+  long m = idx.size();
+  vector<list_node_t *> nodes(m, NULL);   // allocated, not yet published
+  vector<key_type> runKeys(page::cardinality);
+  vector<char *> runPtrs(page::cardinality);
+  long i = 0;
+  while(i < m) {
+    bool found;
+    list_node_t *prev = NULL;
+    page *leaf = NULL;
+    btree_search_pred_test(keys[idx[i]], &found, (char **)&prev, false, &leaf);
+    if(prev == NULL)
+      prev = list_head;
+
+    // anything unexpected ends the leaf and sends key i down the tree again;
+    // the keys after the one we descended for stay if the leaf covers them.
+    // A full leaf takes one key through the per-key path, which splits it.
+    int k = 0, room = std::max(leaf->room(), 1);
+    bool routed = true;
+    while(i < m && k < room) {
+      key_type key = keys[idx[i]];
+      if(!routed && !leaf->covers(key))
+        break;
+      uint64_t oldValue = __atomic_load_n(&(prev->next), __ATOMIC_ACQUIRE);
+      list_node_t *next = (list_node_t *)(oldValue & ptrSet);
+      if((oldValue & deletedSet) != 0 || (prev != list_head && KEY::compare(prev->key, key) >= 0)) {
+        STAT_INC(STAT_INSERT_RETRY);
+        break;
+      }
+      if(next != NULL && (__atomic_load_n(&(next->next), __ATOMIC_ACQUIRE) & deletedSet) != 0) {
+        list_unlink(prev, next);
+        STAT_INC(STAT_INSERT_RETRY);
+        break;
+      }
+
+      int c = (next != NULL) ? KEY::compare(next->key, key) : 1;
+      if(c < 0) {
+        prev = next;
+        continue;
+      }
+      if(c == 0) {
+        next->acquireVersionLock();
+        if((__atomic_load_n(&(next->next), __ATOMIC_ACQUIRE) & deletedSet) != 0) {
+          next->releaseVersion();
+          STAT_INC(STAT_INSERT_RETRY);
+          break;
+        }
+        uint64_t oldPtr = next->ptr, oldSize = next->size;
+        next->ptr = (uint64_t)values[idx[i]];
+        next->size = 0;
+        persist((char *)next, sizeof(list_node_t));
+        next->releaseVersion();
+        retire_value(oldPtr, oldSize);
+        routed = false;
+        i++;
+        continue;
+      }
+
+      long end = i + 1;
+      while(end < m && k + (end - i) < room
+          && (next == NULL || KEY::compare(next->key, keys[idx[end]]) > 0)
+          && leaf->covers(keys[idx[end]]))
+        ++end;
+      for(long j = end - 1; j >= i; j--) {
+        if(nodes[j] == NULL) {
+          nodes[j] = (list_node_t *)alloc(sizeof(list_node_t));
+          nodes[j]->size = 0;
+          nodes[j]->key = KEY::encode(keys[idx[j]]);
+        }
+        nodes[j]->ptr = (uint64_t)values[idx[j]];
+        nodes[j]->next = (j + 1 < end) ? (uint64_t)nodes[j + 1] : (uint64_t)next;
+        persist((char *)nodes[j], sizeof(list_node_t));
+      }
+      if(!CAS(&(prev->next), &oldValue, (oldValue & ~ptrSet) | (uint64_t)nodes[i])) {
+        STAT_INC(STAT_INSERT_RETRY);
+        break;
+      }
+      persist((char *)prev, sizeof(list_node_t));
+
+      for(long j = i; j < end; j++, k++) {
+        // pages keep the list node's copy of the key
+        runKeys[k] = KEY::decode(nodes[j]->key);
+        runPtrs[k] = (char *)nodes[j];
+        nodes[j] = NULL;
+      }
+      prev = (list_node_t *)runPtrs[k - 1];
+      routed = false;
+      i = end;
+    }
+
+    if(k > 0 && !leaf->store_batch(runKeys.data(), runPtrs.data(), k)) {
+      for(int j = 0; j < k; j++) {
+        char *pred = NULL;
+        if(!leaf->store(this, nullptr, runKeys[j], runPtrs[j], true, true, &pred) && pred == NULL)
+          btree_insert_pred(runKeys[j], runPtrs[j], &pred, &found);
+      }
+    }
+  }
+
+  // nodes of keys that turned out to be there already
+  for(long j = 0; j < m; j++)
+    if(nodes[j] != NULL) {
+      KEY::release(nodes[j]->key);
+      dealloc(nodes[j], sizeof(list_node_t));
+    }
+}
+
+// Insert without waiting for msync. The insert is durable once
+// wait_durable() on the returned epoch comes back; backends that persist
+// synchronously return epoch 0. The node and its key are recorded as data,
+// the stores linking it as links, so the group commit writes the node out
+// first.
+template<int NODE_SIZE, typename KEY>
+uint64_t btree_t<NODE_SIZE, KEY>::insert_async(key_type key, char *right) {
+  persist_epoch = 0;
+  persist_deferred = true;
+  insert(key, right);
+  persist_deferred = false;
+  return persist_epoch;
+}
+
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::wait_durable(uint64_t epoch) {
+  if(epoch != 0)
+    groupCommit->wait(epoch);
+}
+
+// Sum of the event counters of all threads so far, all zero unless built
+// with -DUTREE_STATS.
+template<int NODE_SIZE, typename KEY>
+tree_stats btree_t<NODE_SIZE, KEY>::stats() {
+  tree_stats ret;
+#ifdef UTREE_STATS
+  std::lock_guard<std::mutex> lock(stat_blocks_mtx);
+  for(stat_block *b : stat_blocks)
+    for(int i = 0; i < NR_STATS; i++)
+      ret.count[i] += __atomic_load_n(&(b->count[i]), __ATOMIC_RELAXED);
+#endif
+  return ret;
+}
+
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::btree_insert_internal(char *left, key_type key, char *right, uint32_t level) {
   if(level > ((page *)root)->hdr.level)
     return;
 
@@ -981,4 +1676,272 @@ void btree::btree_insert_internal(char *left, entry_key_t key, char *right, uint
   if(!p->store(this, NULL, key, right, true, true)) {
     btree_insert_internal(left, key, right, level);
   }
-}
\ No newline at end of file
+}
+
+template<int NODE_SIZE, typename KEY>
+bool btree_t<NODE_SIZE, KEY>::btree_delete_internal(key_type key, char *child, uint32_t level) {
+  if(level > ((page *)root)->hdr.level)
+    return false;
+
+  page *p = (page *)this->root;
+
+  while(p->hdr.level > level)
+    p = (page *)p->linear_search(key);
+
+  // the parent is either where key routes to or somewhere to its right
+  while(p != NULL) {
+    p->hdr.write_lock();
+    int ret = p->remove_child(child);
+    page *sibling = p->hdr.sibling_ptr;
+    p->hdr.write_unlock();
+
+    if(ret != 0)
+      return ret > 0;
+    p = sibling;
+  }
+  return false;
+}
+
+// Snip marked nodes after prev until cur is out of the list. A marked prev
+// means our predecessor is going away too, so we restart from the leaves.
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::list_unlink(list_node_t *prev, list_node_t *cur) {
+  key_type key = KEY::decode(cur->key);
+  list_node_t *p = (prev != NULL) ? prev : list_head;
+
+  while(true) {
+    uint64_t oldValue = __atomic_load_n(&(p->next), __ATOMIC_ACQUIRE);
+    if((oldValue & deletedSet) != 0) {
+      bool f;
+      char *pred = NULL;
+      btree_search_pred(key, &f, &pred);
+      p = (pred != NULL) ? (list_node_t *)pred : list_head;
+      continue;
+    }
+
+    list_node_t *n = (list_node_t *)(oldValue & ptrSet);
+    if(n == NULL || (n != cur && KEY::compare(n->key, key) >= 0))
+      return;
+
+    uint64_t succ = __atomic_load_n(&(n->next), __ATOMIC_ACQUIRE);
+    if((succ & deletedSet) != 0) {
+      uint64_t newValue = (oldValue & ~ptrSet) | (succ & ptrSet);
+      if(CAS(&(p->next), &oldValue, newValue)) {
+        persist((char*)p, sizeof(list_node_t), true);
+        if(n == cur)
+          return;
+      }
+      continue;
+    }
+    p = n;
+  }
+}
+
+template<int NODE_SIZE, typename KEY>
+bool btree_t<NODE_SIZE, KEY>::remove(key_type key) {
+  bool hasFound;
+  list_node_t *prev = NULL, *cur = NULL;
+  page *leaf = NULL;
+  CLEpochGuard guard;
+
+  cur = (list_node_t*)btree_search_pred_test(key, &hasFound, (char**)&prev, false, &leaf);
+  if(!cur)
+    return false;
+
+  // logical delete: mark the node's own next pointer
+  uint64_t oldValue = __atomic_load_n(&(cur->next), __ATOMIC_ACQUIRE);
+  do {
+    if((oldValue & deletedSet) != 0)
+      return false;
+  } while(!CAS(&(cur->next), &oldValue, oldValue | deletedSet));
+  persist((char*)cur, sizeof(list_node_t));
+
+  // writers check the mark under the lock, so the value is final now
+  cur->acquireVersionLock();
+  uint64_t ptr = cur->ptr, size = cur->size;
+  cur->releaseVersion();
+
+  while(!leaf->remove(this, key))
+    btree_search_pred_test(key, &hasFound, (char**)&prev, false, &leaf);
+
+  list_unlink(prev, cur);
+  // out of the leaf and the list, only concurrent readers can still see it
+  retire_value(ptr, size);
+  epochManager->retire(cur, [](void *p) {
+    KEY::release(((list_node_t *)p)->key);
+    dealloc(p, sizeof(list_node_t));
+  });
+  return true;
+}
+
+// Build the page levels bottom-up over the sorted list nodes. Each level is
+// split into contiguous runs of pages handed to threadNum threads, pages are
+// packed to fill_factor so the first inserts do not split right away.
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::build_index(list_node_t **nodes, long n, double fill_factor, int threadNum) {
+  int per_page = (int)((page::cardinality - 1) * fill_factor);
+  if(per_page < 1)
+    per_page = 1;
+  if(per_page > page::cardinality - 1)
+    per_page = page::cardinality - 1;
+  if(threadNum < 1)
+    threadNum = 1;
+
+  if(n == 0) {
+    root = (char *)new page();
+    height = 1;
+    return;
+  }
+
+  // level 0: entries are list nodes; above it an entry is (low key, child)
+  long num_items = n;
+  int fanout = per_page;
+  uint32_t level = 0;
+  vector<page *> children;
+  vector<key_type> low_keys(n);
+  for(long i = 0; i < n; i++)
+    low_keys[i] = KEY::decode(nodes[i]->key);
+
+  while(true) {
+    long num_pages = (num_items + fanout - 1) / fanout;
+    vector<page *> pages(num_pages);
+    vector<key_type> page_low_keys(num_pages);
+
+    int workers = (num_pages < threadNum) ? (int)num_pages : threadNum;
+    run_parallel(workers, [&](int t) {
+      for(long i = t * num_pages / workers; i < (t + 1) * num_pages / workers; i++) {
+        // spread the items evenly instead of leaving a short last page
+        long start = i * num_items / num_pages;
+        long end = (i + 1) * num_items / num_pages;
+        page *p = new page(level);
+        int cnt = 0;
+        if(level == 0) {
+          for(long j = start; j < end; j++, cnt++) {
+            p->records.set(cnt, low_keys[j], (char *)nodes[j]);
+          }
+        }
+        else {
+          p->hdr.leftmost_ptr = children[start];
+          for(long j = start + 1; j < end; j++, cnt++) {
+            p->records.set(cnt, low_keys[j], (char *)children[j]);
+          }
+        }
+        p->records.ptr(cnt) = NULL;
+        p->records.rebuild(cnt);
+        p->hdr.last_index = cnt - 1;
+        pages[i] = p;
+        page_low_keys[i] = low_keys[start];
+      }
+    });
+    if(level == 0)
+      for(long i = 1; i < num_pages; i++)
+        page_low_keys[i] = KEY::separator(page_low_keys[i]);
+
+    for(long i = 0; i < num_pages; i++) {
+      pages[i]->hdr.sibling_ptr = (i + 1 < num_pages) ? pages[i + 1] : NULL;
+      pages[i]->hdr.pred_ptr = (i > 0) ? pages[i - 1] : NULL;
+    }
+
+    if(num_pages == 1) {
+      root = (char *)pages[0];
+      height = level + 1;
+      return;
+    }
+
+    children.swap(pages);
+    low_keys.swap(page_low_keys);
+    num_items = num_pages;
+    fanout = per_page + 1;
+    ++level;
+  }
+}
+
+// Rebuild the DRAM index from the persisted list. The walk is a single
+// pointer chase; it drops nodes whose removal was interrupted, clears stale
+// version locks and tells the allocator which pool space is still live.
+template<int NODE_SIZE, typename KEY>
+void btree_t<NODE_SIZE, KEY>::recover(int threadNum) {
+  vector<list_node_t *> nodes;
+  pmAllocator->reserve((char *)list_head, sizeof(list_node_t));
+
+  list_node_t *prev = list_head;
+  uint64_t next = list_head->next & versionMask;
+  list_head->next = next;
+  while((next & ptrSet) != 0) {
+    list_node_t *n = (list_node_t *)(next & ptrSet);
+    next = n->next & versionMask;
+    if((next & deletedSet) != 0) {
+      prev->next = (prev->next & ~ptrSet) | (next & ptrSet);
+      persist((char *)prev, sizeof(list_node_t));
+      continue;
+    }
+    n->next = next;
+    pmAllocator->reserve((char *)n, sizeof(list_node_t));
+    KEY::reserve(n->key);
+    if((n->size & valueSet) != 0 && (n->size & inlineSet) == 0)
+      pmAllocator->reserve((char *)n->ptr, value_blob_size(n->size & valueLenSet));
+    nodes.push_back(n);
+    prev = n;
+  }
+
+  build_index(nodes.data(), nodes.size(), DEFAULT_FILL_FACTOR, threadNum);
+}
+
+// Load sorted, unique keys into an empty tree. Every thread allocates the
+// list nodes of one key range from its own pool, the ranges are chained
+// once all nodes exist and build_index() packs the pages to fill_factor.
+template<int NODE_SIZE, typename KEY>
+bool btree_t<NODE_SIZE, KEY>::bulk_load(key_type *keys, char **values, long n, double fill_factor) {
+  if(list_head->next != 0)
+    return false;
+  if(n == 0)
+    return true;
+
+  vector<list_node_t *> nodes(n);
+  int workers = (n < num_threads) ? (int)n : num_threads;
+
+  run_parallel(workers, [&](int t) {
+    worker_id = t;
+    for(long i = t * n / workers; i < (t + 1) * n / workers; i++) {
+      list_node_t *node = (list_node_t *)alloc(sizeof(list_node_t));
+      node->ptr = (uint64_t)values[i];
+      node->key = KEY::encode(keys[i]);
+      node->size = 0;
+      nodes[i] = node;
+    }
+  });
+
+  run_parallel(workers, [&](int t) {
+    long start = t * n / workers, end = (t + 1) * n / workers;
+    for(long i = start; i < end; i++)
+      nodes[i]->next = (i + 1 < n) ? (uint64_t)nodes[i + 1] : 0;
+
+    // all nodes of the range are written, so a node that lies in the unit
+    // persist() covered last needs no call of its own. msync writes back
+    // whole pages, the flush instructions only the lines they are given.
+#ifdef PERSIST_MSYNC
+    const uintptr_t unit = PAGE_SIZE;
+#else
+    const uintptr_t unit = CACHE_LINE_SIZE;
+#endif
+    uintptr_t last = 0;
+    for(long i = start; i < end; i++) {
+      uintptr_t first = (uintptr_t)nodes[i] / unit;
+      uintptr_t end_unit = ((uintptr_t)nodes[i] + sizeof(list_node_t) - 1) / unit;
+      if(first != last || end_unit != last) {
+        persist((char *)nodes[i], sizeof(list_node_t));
+        last = end_unit;
+      }
+    }
+  });
+
+  list_head->next = (uint64_t)nodes[0];
+  persist((char *)list_head, sizeof(list_node_t));
+
+  build_index(nodes.data(), n, fill_factor, num_threads);
+  return true;
+}
+
+typedef page_t<PAGESIZE> page;
+typedef btree_t<PAGESIZE> btree;
+typedef btree_t<PAGESIZE, string_keys> string_btree;
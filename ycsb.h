@@ -0,0 +1,228 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+
+// Operation codes, the same as run.cc uses for the trace files.
+enum YcsbOp { YCSB_READ = 0, YCSB_INSERT = 1, YCSB_UPDATE = 2, YCSB_DELETE = 3, YCSB_SCAN = 4, YCSB_RMW = 5,
+  YCSB_NR_OPS = 6 };
+
+enum YcsbDist { DIST_ZIPFIAN, DIST_UNIFORM, DIST_LATEST, DIST_SEQUENTIAL };
+
+// Zipfian over [0, items) after Gray et al., "Quickly generating
+// billion-record synthetic databases", as in YCSB. The item count can grow;
+// zeta is then extended instead of recomputed.
+class Zipfian{
+  private:
+    uint64_t items;
+    double theta, alpha, zeta2, zetan, eta;
+
+    static double zeta(uint64_t from, uint64_t to, double theta) {
+      double sum = 0;
+      for(uint64_t i = from + 1; i <= to; i++)
+        sum += 1 / pow((double)i, theta);
+      return sum;
+    }
+
+  public:
+    Zipfian() : items(0), theta(0), alpha(0), zeta2(0), zetan(0), eta(0) {}
+
+    void init(uint64_t n, double theta) {
+      this->items = n;
+      this->theta = theta;
+      alpha = 1 / (1 - theta);
+      zeta2 = zeta(0, 2, theta);
+      zetan = zeta(0, n, theta);
+      eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    void grow(uint64_t n) {
+      if(n <= items)
+        return;
+      zetan += zeta(items, n, theta);
+      items = n;
+      eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    // u uniform in [0, 1)
+    uint64_t next(double u) {
+      double uz = u * zetan;
+      if(uz < 1)
+        return 0;
+      if(uz < 1 + pow(0.5, theta))
+        return 1;
+      uint64_t v = (uint64_t)(items * pow(eta * u - eta + 1, alpha));
+      return (v < items) ? v : items - 1;
+    }
+};
+
+static inline uint64_t fnv_hash64(uint64_t v) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(int i = 0; i < 8; i++) {
+    h ^= v & 0xff;
+    h *= 0x100000001b3ULL;
+    v >>= 8;
+  }
+  return h;
+}
+
+// What to generate. Ratios are percentages indexed by YcsbOp.
+struct YcsbSpec{
+  int ratio[YCSB_NR_OPS];
+  YcsbDist dist;
+  double theta;
+  uint64_t records;
+  uint64_t operations;
+  int max_scan;
+
+  YcsbSpec() : dist(DIST_ZIPFIAN), theta(0.99), records(0), operations(0), max_scan(100) {
+    preset('A');
+  }
+
+  // The core YCSB workloads.
+  bool preset(char w) {
+    int r = 0, u = 0, i = 0, s = 0, rmw = 0;
+    dist = DIST_ZIPFIAN;
+    switch(w) {
+      case 'A': r = 50; u = 50; break;
+      case 'B': r = 95; u = 5; break;
+      case 'C': r = 100; break;
+      case 'D': r = 95; i = 5; dist = DIST_LATEST; break;
+      case 'E': s = 95; i = 5; break;
+      case 'F': r = 50; rmw = 50; break;
+      default: return false;
+    }
+    set_mix(r, u, i, 0, s);
+    ratio[YCSB_RMW] = rmw;
+    return true;
+  }
+
+  void set_mix(int r, int u, int i, int d, int s) {
+    ratio[YCSB_READ] = r;
+    ratio[YCSB_UPDATE] = u;
+    ratio[YCSB_INSERT] = i;
+    ratio[YCSB_DELETE] = d;
+    ratio[YCSB_SCAN] = s;
+    ratio[YCSB_RMW] = 0;
+  }
+
+  // "read,update,insert,delete,scan" percentages, summing to 100
+  bool parse_mix(const char *s) {
+    int r, u, i, d, sc;
+    if(sscanf(s, "%d,%d,%d,%d,%d", &r, &u, &i, &d, &sc) != 5 || r + u + i + d + sc != 100)
+      return false;
+    set_mix(r, u, i, d, sc);
+    return true;
+  }
+
+  bool parse_dist(const char *s) {
+    if(strcmp(s, "zipfian") == 0) dist = DIST_ZIPFIAN;
+    else if(strcmp(s, "uniform") == 0) dist = DIST_UNIFORM;
+    else if(strcmp(s, "latest") == 0) dist = DIST_LATEST;
+    else if(strcmp(s, "sequential") == 0) dist = DIST_SEQUENTIAL;
+    else return false;
+    return true;
+  }
+};
+
+// State shared by the generating threads. Record i has key key(i); the
+// first spec.records records are loaded, inserts take the next indices.
+class YcsbWorkload{
+  public:
+    YcsbSpec spec;
+    std::atomic<uint64_t> inserted;
+    Zipfian zipf;
+    uint64_t zipf_items;
+
+    YcsbWorkload(const YcsbSpec &s) : spec(s) {
+      inserted = spec.records;
+      // like YCSB, the zipfian covers the records the run is expected to
+      // insert too; choices beyond the current count are drawn again
+      zipf_items = spec.records + spec.operations * spec.ratio[YCSB_INSERT] / 100;
+      if(spec.dist == DIST_ZIPFIAN)
+        zipf.init(zipf_items, spec.theta);
+      else if(spec.dist == DIST_LATEST)
+        zipf.init(spec.records, spec.theta);   // each thread grows its copy
+    }
+
+    // Spread the record indices over the key space, never 0.
+    static inline uint64_t key(uint64_t index) {
+      return (fnv_hash64(index) >> 1) | 1;
+    }
+};
+
+// One per thread, so drawing an operation touches no shared state apart
+// from the insert counter.
+class YcsbGenerator{
+  private:
+    YcsbWorkload *wl;
+    uint64_t rng;
+    uint64_t seq;
+    Zipfian latest;       // zipfian over the current count, for DIST_LATEST
+    int cumulative[YCSB_NR_OPS];
+
+    inline uint64_t next_rand() {   // xorshift64*
+      rng ^= rng >> 12;
+      rng ^= rng << 25;
+      rng ^= rng >> 27;
+      return rng * 0x2545f4914f6cdd1dULL;
+    }
+
+    inline double next_double() {
+      return (next_rand() >> 11) * (1.0 / (1ULL << 53));
+    }
+
+    uint64_t choose(uint64_t count) {
+      switch(wl->spec.dist) {
+        case DIST_UNIFORM:
+          return next_rand() % count;
+        case DIST_SEQUENTIAL:
+          return seq++ % count;
+        case DIST_LATEST:
+          latest.grow(count);
+          return count - 1 - latest.next(next_double());
+        default: {
+          uint64_t i;
+          do {
+            i = fnv_hash64(wl->zipf.next(next_double())) % wl->zipf_items;
+          } while(i >= count);
+          return i;
+        }
+      }
+    }
+
+  public:
+    YcsbGenerator(YcsbWorkload *w, int thread) : wl(w) {
+      rng = fnv_hash64(thread + 1) | 1;
+      // sequential threads start at different records
+      seq = fnv_hash64(thread);
+      if(wl->spec.dist == DIST_LATEST)
+        latest = wl->zipf;
+      int sum = 0;
+      for(int op = 0; op < YCSB_NR_OPS; op++) {
+        sum += wl->spec.ratio[op];
+        cumulative[op] = sum;
+      }
+    }
+
+    // Next operation; range is the scan length.
+    int next(uint64_t *key, uint64_t *range) {
+      int dice = next_rand() % 100, op = 0;
+      while(op < YCSB_NR_OPS - 1 && dice >= cumulative[op])
+        ++op;
+
+      if(op == YCSB_INSERT) {
+        *key = YcsbWorkload::key(wl->inserted.fetch_add(1, std::memory_order_relaxed));
+      } else {
+        uint64_t count = wl->inserted.load(std::memory_order_relaxed);
+        *key = YcsbWorkload::key(choose(count ? count : 1));
+      }
+      if(op == YCSB_SCAN)
+        *range = 1 + next_rand() % wl->spec.max_scan;
+      return op;
+    }
+};